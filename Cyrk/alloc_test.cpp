@@ -0,0 +1,93 @@
+// Sprawdza, ze lista produktow zamowienia przechodzi przez kolejke, workera i raport bez kopiowania.
+// Nazwy produktow maja nietypowe dlugosci, wiec kazda ich kopia to alokacja o znanym rozmiarze.
+// Jedyna dozwolona kopia nazwy to ta w SimulatedProduct - po jednej na wyprodukowany produkt.
+//
+// g++ -std=c++20 -pthread alloc_test.cpp system.cpp simulation.cpp -o alloc_test && ./alloc_test
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "simulation.hpp"
+
+namespace {
+    const std::string burger(40, 'b');
+    const std::string fries(50, 'f');
+
+    std::atomic<bool> counting(false);
+    std::atomic<unsigned int> burger_copies(0);
+    std::atomic<unsigned int> fries_copies(0);
+}
+
+void *operator new(std::size_t size) {
+    if(counting){
+        if(size == burger.size() + 1){
+            burger_copies++;
+        } else if(size == fries.size() + 1){
+            fries_copies++;
+        }
+    }
+    void *pointer = std::malloc(size);
+    if(pointer == nullptr){
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+// noinline - inaczej GCC, widzac free() na wskazniku z operator new, zglasza -Wmismatched-new-delete
+[[gnu::noinline]] void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    operator delete(pointer);
+}
+
+int main() {
+    constexpr unsigned int orders = 100;
+
+    auto clock = std::make_shared<RealClock>();
+    auto burger_machine = std::make_shared<SimulatedMachine>(burger, clock, Clock::duration::zero());
+    auto fries_machine = std::make_shared<SimulatedMachine>(fries, clock, Clock::duration::zero());
+
+    System::machines_t machines;
+    machines[burger] = burger_machine;
+    machines[fries] = fries_machine;
+
+    unsigned int collected = 0;
+    {
+        System system(machines, 2, 1000);
+
+        // zamowienia budujemy przed liczeniem - od order() dalej nie powinno byc juz zadnej kopii
+        std::vector<std::vector<std::string>> payloads;
+        for(unsigned int i = 0; i < orders; i++){
+            payloads.push_back(i % 2 ? std::vector<std::string>{burger, fries} : std::vector<std::string>{burger});
+        }
+
+        counting = true;
+        for(auto &payload : payloads){
+            auto pager = system.order(std::move(payload));
+            pager->wait();
+            system.collectOrder(std::move(pager));
+        }
+        auto reports = system.shutdown();
+        counting = false;
+
+        for(const auto &report : reports){
+            collected += report.collectedOrders.size();
+        }
+    }
+
+    unsigned int burgers = burger_machine->getProduced();
+    unsigned int fries_made = fries_machine->getProduced();
+
+    std::printf("orders %u collected %u\n", orders, collected);
+    std::printf("%s: produced %u, name allocations %u\n", "burger", burgers, burger_copies.load());
+    std::printf("%s: produced %u, name allocations %u\n", "fries", fries_made, fries_copies.load());
+
+    if(collected != orders || burger_copies != burgers || fries_copies != fries_made){
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
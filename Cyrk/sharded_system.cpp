@@ -0,0 +1,285 @@
+#include "sharded_system.hpp"
+
+#include <algorithm>
+#include <map>
+
+
+//***************************************************
+//**               SHARDED PAGER                   **
+//***************************************************
+ShardedPager::ShardedPager(unsigned int new_id, std::shared_ptr<Clock> clock_in) {
+    id = new_id;
+    clock = std::move(clock_in);
+}
+
+void ShardedPager::wait() const {
+    for(auto & part : parts){
+        part.second->wait();
+    }
+}
+
+void ShardedPager::wait(const unsigned int timeout) const {
+    wait_until(clock->now() + std::chrono::milliseconds(timeout));
+}
+
+void ShardedPager::wait_until(Clock::time_point deadline) const {
+    for(auto & part : parts){
+        part.second->wait_until(deadline);
+    }
+}
+
+unsigned int ShardedPager::getId() const {
+    return id;
+}
+
+bool ShardedPager::isReady() const {
+    for(auto & part : parts){
+        if(!part.second->isReady()){
+            return false;
+        }
+    }
+    return true;
+}
+
+std::chrono::steady_clock::time_point ShardedPager::estimatedReadyTime() const {
+    std::chrono::steady_clock::time_point result;
+    for(auto & part : parts){
+        result = std::max(result, part.second->estimatedReadyTime());
+    }
+    return result;
+}
+
+//***************************************************
+//**               SHARDED SYSTEM                  **
+//***************************************************
+
+ShardedSystem::ShardedSystem(machines_t machines_in, unsigned int numberOfShards, unsigned int workersPerShard,
+                             unsigned int clientTimeout_in, SystemConfig config_in) :
+        id(0),
+        clientTimeout(clientTimeout_in),
+        clock(config_in.clock ? config_in.clock : std::make_shared<RealClock>())
+{
+    config_in.clock = clock;
+
+    std::vector<std::string> names;
+    for(const auto& part : machines_in){
+        names.push_back(part.first);
+    }
+    std::sort(names.begin(), names.end());
+
+    numberOfShards = std::max(1u, std::min(numberOfShards, (unsigned int) names.size()));
+
+    std::vector<machines_t> groups(numberOfShards);
+    for(unsigned int i = 0;i < names.size();i++){
+        shard_of[names[i]] = i % numberOfShards;
+        groups[i % numberOfShards][names[i]] = std::move(machines_in[names[i]]);
+    }
+
+    for(unsigned int i = 0;i < numberOfShards;i++){
+        // kazdy shard dostaje wlasny, spojny kawalek zbiorow procesorow - jego stan maszyn
+        // trafia wtedy na wezel NUMA jego workerow
+        SystemConfig config = config_in;
+        if(!config_in.workerCpus.empty()){
+            auto sets = config_in.workerCpus.size();
+            auto from = i * sets / numberOfShards;
+            auto to = std::max(from + 1, (i + 1) * sets / numberOfShards);
+            config.workerCpus.clear();
+            for(auto j = from;j < to;j++){
+                config.workerCpus.push_back(config_in.workerCpus[j % sets]);
+            }
+            config.numaNode = -1;
+        }
+        shards.push_back(std::make_unique<System>(std::move(groups[i]), workersPerShard, clientTimeout, config));
+    }
+}
+
+std::vector<WorkerReport> ShardedSystem::shutdown() {
+    std::vector<WorkerReport> result;
+    for(auto & shard : shards){
+        for(auto & report : shard->shutdown()){
+            result.push_back(std::move(report));
+        }
+    }
+    return result;
+}
+
+std::vector<std::string> ShardedSystem::getMenu() const {
+    std::vector<std::string> result;
+    for(auto & shard : shards){
+        for(auto & record : shard->getMenu()){
+            result.push_back(std::move(record));
+        }
+    }
+    return result;
+}
+
+std::unique_ptr<ShardedPager> ShardedSystem::order(std::vector<std::string> products) {
+    return order(std::move(products), Clock::time_point::max());
+}
+
+std::unique_ptr<ShardedPager> ShardedSystem::order(std::vector<std::string> products, Clock::time_point deadline,
+                                                   unsigned int tenant) {
+    if(products.empty()){throw BadOrderException();}
+
+    std::vector<std::vector<std::string>> split(shards.size());
+    for(auto & food : products){
+        auto shard = shard_of.find(food);
+        if(shard == shard_of.end()){
+            throw BadOrderException();
+        }
+        split[shard->second].push_back(std::move(food));
+    }
+
+    auto result = std::unique_ptr<ShardedPager>(new ShardedPager(++id, clock));
+
+    std::vector<unsigned int> involved;
+    for(unsigned int i = 0;i < split.size();i++){
+        if(!split[i].empty()){
+            involved.push_back(i);
+        }
+    }
+
+    // zamowienie z jednego shardu - zwykla sciezka bez koordynacji
+    if(involved.size() == 1){
+        unsigned int i = involved.front();
+        std::unique_ptr<CoasterPager> part;
+        throw_on_error(shards[i]->tryOrder(std::move(split[i]), part, deadline, tenant));
+        result->parts.emplace_back(i, std::move(part));
+        return result;
+    }
+
+    // faza 1: rezerwujemy kolejki wszystkich shardow (zawsze w rosnacej kolejnosci) i walidujemy
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for(auto i : involved){
+        locks.push_back(shards[i]->lockOrders());
+        throw_on_error(shards[i]->validateOrder(split[i]));
+        // trzymamy blokady innych shardow - nie wolno tu czekac na miejsce w kolejce
+        throw_on_error(shards[i]->admitOrder(split[i], locks.back(), false, deadline, tenant));
+    }
+
+    // faza 2: wszystkie shardy zaakceptowaly - wstawiamy zamowienia czesciowe
+    for(auto i : involved){
+        std::unique_ptr<CoasterPager> part;
+        throw_on_error(shards[i]->enqueueOrder(std::move(split[i]), part, deadline, tenant, false));
+        result->parts.emplace_back(i, std::move(part));
+    }
+    locks.clear();
+
+    for(auto i : involved){
+        shards[i]->notifyWorkers();
+    }
+
+    return result;
+}
+
+std::vector<std::unique_ptr<Product>> ShardedSystem::collectOrder(std::unique_ptr<ShardedPager> pager) {
+    std::vector<std::unique_ptr<CoasterPager>*> parts;
+    for(auto & part : pager->parts){
+        parts.push_back(&part.second);
+    }
+
+    std::vector<std::unique_ptr<Product>> result;
+    auto error = System::tryCollectOrders(parts, result);
+    if(error != OrderError::OK){
+        // pager przepada razem z wywolaniem - nieodebranych czesci nie wolno zniszczyc, dopoki ich
+        // workery z nich korzystaja; udane oddadza produkty maszynom po czasie na odbior
+        for(auto & part : pager->parts){
+            shards[part.first]->abandonOrder(std::move(part.second));
+        }
+    }
+    throw_on_error(error);
+    return result;
+}
+
+unsigned int ShardedSystem::getClientTimeout() const {
+    return clientTimeout;
+}
+
+std::vector<MachineHealthReport> ShardedSystem::getMachinesHealth() const {
+    std::vector<MachineHealthReport> result;
+    for(auto & shard : shards){
+        for(auto & report : shard->getMachinesHealth()){
+            result.push_back(std::move(report));
+        }
+    }
+    return result;
+}
+
+unsigned int ShardedSystem::getRejectedOrders() const {
+    unsigned int result = 0;
+    for(auto & shard : shards){
+        result += shard->getRejectedOrders();
+    }
+    return result;
+}
+
+std::chrono::milliseconds ShardedSystem::estimateOrder(const std::vector<std::string> &products) const {
+    std::vector<std::vector<std::string>> split(shards.size());
+    for(auto & food : products){
+        auto shard = shard_of.find(food);
+        if(shard != shard_of.end()){
+            split[shard->second].push_back(food);
+        }
+    }
+
+    std::chrono::milliseconds result(0);
+    for(unsigned int i = 0;i < split.size();i++){
+        if(!split[i].empty()){
+            result = std::max(result, shards[i]->estimateOrder(split[i]));
+        }
+    }
+    return result;
+}
+
+std::vector<MachineLatencyReport> ShardedSystem::getMachinesLatency() const {
+    std::vector<MachineLatencyReport> result;
+    for(auto & shard : shards){
+        for(auto & report : shard->getMachinesLatency()){
+            result.push_back(std::move(report));
+        }
+    }
+    return result;
+}
+
+std::vector<MachineContentionReport> ShardedSystem::getMachinesContention() const {
+    std::vector<MachineContentionReport> result;
+    for(auto & shard : shards){
+        for(auto & report : shard->getMachinesContention()){
+            result.push_back(std::move(report));
+        }
+    }
+    return result;
+}
+
+unsigned int ShardedSystem::getShardOf(const std::string &product) const {
+    return shard_of.at(product);
+}
+
+std::vector<TenantReport> ShardedSystem::getTenantsReport() {
+    std::map<unsigned int, TenantReport> merged;
+    for(auto & shard : shards){
+        for(auto & report : shard->getTenantsReport()){
+            auto found = merged.find(report.tenant);
+            if(found == merged.end()){
+                merged[report.tenant] = report;
+                continue;
+            }
+            auto & total = found->second;
+            auto served = total.servedOrders + report.servedOrders;
+            if(served > 0){
+                total.avgQueueMs = (total.avgQueueMs * total.servedOrders + report.avgQueueMs * report.servedOrders) / served;
+            }
+            total.maxQueueMs = std::max(total.maxQueueMs, report.maxQueueMs);
+            total.queuedOrders += report.queuedOrders;
+            total.acceptedOrders += report.acceptedOrders;
+            total.rejectedOrders += report.rejectedOrders;
+            total.servedOrders = served;
+        }
+    }
+
+    std::vector<TenantReport> result;
+    for(auto & report : merged){
+        result.push_back(report.second);
+    }
+    return result;
+}
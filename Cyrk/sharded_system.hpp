@@ -0,0 +1,94 @@
+#ifndef SHARDED_SYSTEM_HPP
+#define SHARDED_SYSTEM_HPP
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "system.hpp"
+
+//***************************************************
+//**               SHARDED PAGER                   **
+//***************************************************
+
+class ShardedPager
+{
+public:
+    void wait() const;
+
+    void wait(unsigned int timeout) const;
+
+    void wait_until(Clock::time_point deadline) const;
+
+    [[nodiscard]] unsigned int getId() const;
+
+    [[nodiscard]] bool isReady() const;
+
+    [[nodiscard]] std::chrono::steady_clock::time_point estimatedReadyTime() const;
+
+private:
+    ShardedPager(unsigned int new_id, std::shared_ptr<Clock> clock_in);
+
+    unsigned int id;
+
+    std::shared_ptr<Clock> clock;
+
+    // (numer shardu, pager zamowienia czesciowego w tym shardzie)
+    std::vector<std::pair<unsigned int, std::unique_ptr<CoasterPager>>> parts;
+
+    friend class ShardedSystem;
+};
+
+//***************************************************
+//**               SHARDED SYSTEM                  **
+//***************************************************
+
+class ShardedSystem
+{
+public:
+    typedef std::unordered_map<std::string, std::shared_ptr<Machine>> machines_t;
+
+    ShardedSystem(machines_t machines_in, unsigned int numberOfShards, unsigned int workersPerShard,
+                  unsigned int clientTimeout_in, SystemConfig config_in = SystemConfig());
+
+    std::vector<WorkerReport> shutdown();
+
+    std::vector<std::string> getMenu() const;
+
+    std::unique_ptr<ShardedPager> order(std::vector<std::string> products);
+
+    std::unique_ptr<ShardedPager> order(std::vector<std::string> products, Clock::time_point deadline,
+                                        unsigned int tenant = 0);
+
+    std::vector<std::unique_ptr<Product>> collectOrder(std::unique_ptr<ShardedPager> pager);
+
+    unsigned int getClientTimeout() const;
+
+    std::vector<MachineHealthReport> getMachinesHealth() const;
+
+    unsigned int getRejectedOrders() const;
+
+    std::chrono::milliseconds estimateOrder(const std::vector<std::string> &products) const;
+
+    std::vector<MachineLatencyReport> getMachinesLatency() const;
+
+    std::vector<MachineContentionReport> getMachinesContention() const;
+
+    unsigned int getShardOf(const std::string &product) const;
+
+    // Raport tenantow zsumowany po shardach (czasy oczekiwania - maksimum / srednia wazona).
+    std::vector<TenantReport> getTenantsReport();
+
+private:
+    std::vector<std::unique_ptr<System>> shards;
+
+    std::unordered_map<std::string, unsigned int> shard_of;
+
+    std::atomic<unsigned int> id;
+    unsigned int clientTimeout;
+
+    // wspolny zegar wszystkich shardow
+    std::shared_ptr<Clock> clock;
+};
+
+#endif // SHARDED_SYSTEM_HPP
@@ -0,0 +1,160 @@
+#include "simulation.hpp"
+
+
+//***************************************************
+//**               VIRTUAL CLOCK                   **
+//***************************************************
+VirtualClock::VirtualClock() : current(0), pending(0) {}
+
+Clock::time_point VirtualClock::now() const {
+    return time_point(duration(current.load()));
+}
+
+VirtualClock::waiters_t::iterator VirtualClock::enter(time_point deadline, Waiter &waiter) {
+    return waiters.emplace(deadline, &waiter);
+}
+
+void VirtualClock::leave(waiters_t::iterator it) {
+    if(it->second->released && --pending == 0){
+        handed.notify_all();
+    }
+    waiters.erase(it);
+}
+
+void VirtualClock::release(std::unique_lock<std::mutex> &lock) {
+    auto end = waiters.upper_bound(now());
+    for(auto it = waiters.begin(); it != end; ++it){
+        Waiter *waiter = it->second;
+        if(waiter->released){
+            continue;
+        }
+        waiter->released = true;
+        pending++;
+        if(waiter->cv != nullptr){
+            // czekajacy sprawdza czas pod swoim muteksem - po jego zwolnieniu albo widzi nowy czas, albo juz spi
+            std::unique_lock<std::mutex> lock_waiter(*waiter->mutex);
+            lock_waiter.unlock();
+            waiter->cv->notify_all();
+        }
+    }
+    tick.notify_all();
+    handed.wait(lock, [this]{return pending == 0;});
+}
+
+bool VirtualClock::wait_until(std::condition_variable &cv, std::unique_lock<std::mutex> &lock,
+                              time_point deadline, const std::function<bool()> &pred) {
+    if(deadline == time_point::max()){
+        // bez terminu - jak w RealClock; max() w terminach przesunalby czas na koniec swiata
+        cv.wait(lock, pred);
+        return true;
+    }
+
+    Waiter waiter{&cv, lock.mutex(), false};
+
+    // m nie wolno brac, trzymajac muteks czekajacego - release() bierze je w odwrotnej kolejnosci
+    lock.unlock();
+    std::unique_lock<std::mutex> lock_clock(m);
+    auto it = enter(deadline, waiter);
+    lock_clock.unlock();
+    lock.lock();
+
+    while(!pred() && now() < deadline){
+        cv.wait(lock);
+    }
+
+    lock.unlock();
+    lock_clock.lock();
+    leave(it);
+    lock_clock.unlock();
+    lock.lock();
+
+    return pred();
+}
+
+void VirtualClock::sleep_until(time_point deadline) {
+    std::unique_lock<std::mutex> lock(m);
+    if(deadline == time_point::max()){
+        tick.wait(lock, [&]{return false;});
+    }
+    Waiter waiter{nullptr, nullptr, false};
+    auto it = enter(deadline, waiter);
+    tick.wait(lock, [&]{return now() >= deadline;});
+    leave(it);
+}
+
+void VirtualClock::advance(duration step) {
+    std::unique_lock<std::mutex> lock(m);
+    current += step.count();
+    release(lock);
+}
+
+void VirtualClock::advance_to(time_point target) {
+    std::unique_lock<std::mutex> lock(m);
+    if(target > now()){
+        current = target.time_since_epoch().count();
+    }
+    release(lock);
+}
+
+bool VirtualClock::advance_to_next() {
+    std::unique_lock<std::mutex> lock(m);
+    if(waiters.empty()){
+        return false;
+    }
+    if(waiters.begin()->first > now()){
+        current = waiters.begin()->first.time_since_epoch().count();
+    }
+    release(lock);
+    return true;
+}
+
+unsigned int VirtualClock::waiting() const {
+    std::lock_guard<std::mutex> lock(m);
+    return waiters.size();
+}
+
+//***************************************************
+//**               SIMULATED MACHINE               **
+//***************************************************
+SimulatedMachine::SimulatedMachine(std::string name_in, std::shared_ptr<Clock> clock_in,
+                                   Clock::duration productionTime_in, std::set<unsigned int> failAt_in) :
+        name(std::move(name_in)),
+        clock(std::move(clock_in)),
+        productionTime(productionTime_in),
+        failAt(std::move(failAt_in)),
+        produced(0),
+        returned(0),
+        running(false)
+{
+}
+
+std::unique_ptr<Product> SimulatedMachine::getProduct() {
+    unsigned int number = produced++;
+    clock->sleep_for(productionTime);
+    if(!running || failAt.count(number)){
+        throw SimulatedMachineFailure();
+    }
+    return std::make_unique<SimulatedProduct>(name);
+}
+
+void SimulatedMachine::returnProduct(std::unique_ptr<Product> product) {
+    if(product != nullptr){
+        returned++;
+    }
+}
+
+void SimulatedMachine::start() {
+    running = true;
+}
+
+void SimulatedMachine::stop() {
+    running = false;
+}
+
+unsigned int SimulatedMachine::getProduced() const {
+    return produced;
+}
+
+unsigned int SimulatedMachine::getReturned() const {
+    return returned;
+}
@@ -0,0 +1,115 @@
+#ifndef SIMULATION_HPP
+#define SIMULATION_HPP
+
+#include <set>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "system.hpp"
+
+//***************************************************
+//**               VIRTUAL CLOCK                   **
+//***************************************************
+
+// Czas wirtualny: stoi w miejscu, dopoki symulacja go nie przesunie (advance / advance_to_next).
+// Wszyscy czekajacy z limitem czasu rejestruja swoje terminy (razem ze swoim cv), wiec advance_to_next()
+// przeskakuje od razu do najblizszego zdarzenia - dzien ruchu mozna odtworzyc w sekundy.
+// Przesuniecie czasu budzi kazdego, czyj termin minal, i wraca dopiero, gdy wszyscy obudzeni
+// wyszli z oczekiwania - to, co robia potem, dzieje sie juz wspolbieznie z symulacja.
+class VirtualClock : public Clock {
+public:
+    VirtualClock();
+
+    time_point now() const override;
+
+    bool wait_until(std::condition_variable &cv, std::unique_lock<std::mutex> &lock,
+                    time_point deadline, const std::function<bool()> &pred) override;
+
+    void sleep_until(time_point deadline) override;
+
+    void advance(duration step);
+
+    void advance_to(time_point target);
+
+    // Przesuwa czas do najblizszego zarejestrowanego terminu; false, gdy nikt nie czeka z terminem.
+    bool advance_to_next();
+
+    // Liczba watkow czekajacych teraz na czas wirtualny.
+    unsigned int waiting() const;
+
+private:
+    struct Waiter {
+        // nullptr dla sleep_until - ten czeka na tick pod m
+        std::condition_variable *cv;
+        std::mutex *mutex;
+        bool released;
+    };
+
+    using waiters_t = std::multimap<time_point, Waiter*>;
+
+    waiters_t::iterator enter(time_point deadline, Waiter &waiter);
+
+    void leave(waiters_t::iterator it);
+
+    // Budzi czekajacych z terminem <= current i czeka, az wszyscy wyjda z oczekiwania; wymaga m.
+    void release(std::unique_lock<std::mutex> &lock);
+
+    mutable std::mutex m;
+    std::condition_variable tick;
+    std::condition_variable handed;
+
+    // atomowe, zeby now() nie bralo m - release() trzyma m, biorac muteksy czekajacych
+    std::atomic<duration::rep> current;
+    waiters_t waiters;
+    unsigned int pending;
+};
+
+//***************************************************
+//**               SIMULATED MACHINE               **
+//***************************************************
+
+class SimulatedMachineFailure : public std::exception
+{
+};
+
+class SimulatedProduct : public Product
+{
+public:
+    explicit SimulatedProduct(std::string name_in) : name(std::move(name_in)) {}
+
+    std::string name;
+};
+
+// Maszyna, ktorej produkcja trwa zadany czas na zegarze Systemu i ktora psuje sie
+// deterministycznie - przy wywolaniach getProduct() o numerach (od 0) z failAt.
+class SimulatedMachine : public Machine
+{
+public:
+    SimulatedMachine(std::string name_in, std::shared_ptr<Clock> clock_in, Clock::duration productionTime_in,
+                     std::set<unsigned int> failAt_in = {});
+
+    std::unique_ptr<Product> getProduct() override;
+
+    void returnProduct(std::unique_ptr<Product> product) override;
+
+    void start() override;
+
+    void stop() override;
+
+    unsigned int getProduced() const;
+
+    unsigned int getReturned() const;
+
+private:
+    std::string name;
+    std::shared_ptr<Clock> clock;
+    Clock::duration productionTime;
+    std::set<unsigned int> failAt;
+
+    std::atomic<unsigned int> produced;
+    std::atomic<unsigned int> returned;
+    std::atomic<bool> running;
+};
+
+#endif // SIMULATION_HPP
@@ -1,40 +1,168 @@
 #include "system.hpp"
 
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+
 
 typedef std::unordered_map<std::string, std::shared_ptr<Machine>> machines_t;
-typedef std::unordered_map<std::string, std::unique_ptr<FairMutex>> mutex_t;
-typedef std::queue<std::pair<std::vector<std::string>, pagers_data>> queue_t;
+typedef std::atomic<std::shared_ptr<const machine_table_t>> table_t;
+typedef FairQueue queue_t;
+
+
+//***************************************************
+//**               PLACEMENT                       **
+//***************************************************
+void pin_thread(std::thread::native_handle_type handle, const std::vector<int> &cpus) {
+    if(cpus.empty()){
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(auto cpu : cpus){
+        CPU_SET(cpu, &set);
+    }
+    // przypinanie to tylko optymalizacja - blad (np. brak procesora) ignorujemy
+    pthread_setaffinity_np(handle, sizeof(set), &set);
+}
 
+int numa_node_of(const std::vector<int> &cpus) {
+#if CYRK_HAVE_NUMA
+    if(!cpus.empty() && numa_available() >= 0){
+        return numa_node_of_cpu(cpus.front());
+    }
+#endif
+    (void) cpus;
+    return -1;
+}
+
+//***************************************************
+//**               ERROR CODES                     **
+//***************************************************
+void throw_on_error(OrderError error) {
+    switch(error) {
+        case OrderError::OK:
+            return;
+        case OrderError::FULFILLMENT_FAILURE:
+            throw FulfillmentFailure();
+        case OrderError::ORDER_NOT_READY:
+            throw OrderNotReadyException();
+        case OrderError::BAD_ORDER:
+            throw BadOrderException();
+        case OrderError::BAD_PAGER:
+            throw BadPagerException();
+        case OrderError::ORDER_EXPIRED:
+            throw OrderExpiredException();
+        case OrderError::RESTAURANT_CLOSED:
+            throw RestaurantClosedException();
+        case OrderError::ORDER_REJECTED:
+            throw OrderRejectedException();
+    }
+}
 
 //***************************************************
 //**               COASTER PAGER                   **
 //***************************************************
-CoasterPager::CoasterPager(unsigned int new_id) {
+CoasterPager::CoasterPager(unsigned int new_id, std::shared_ptr<Clock> clock_in) {
     id = new_id;
+    clock = std::move(clock_in);
     is_ready = false;
     failed = false;
     expired = false;
     taken = false;
+    released = false;
+    streaming = false;
+    delivered = 0;
+    deadline = Clock::time_point::max();
+    pickup_deadline = Clock::time_point::max();
 }
 
 void CoasterPager::wait() const {
+    throw_on_error(tryWait());
+}
+
+void CoasterPager::wait(const unsigned int timeout) const {
+    auto error = tryWait(timeout);
+    if(error != OrderError::ORDER_NOT_READY){
+        throw_on_error(error);
+    }
+}
+
+OrderError CoasterPager::tryWait() const {
     std::unique_lock <std::mutex> lock(mutex_wait);
     cv_wait.wait(lock, [this] { return is_ready; });
     if(failed){
         taken = true;
-        throw FulfillmentFailure();
+        return OrderError::FULFILLMENT_FAILURE;
     }
+    return OrderError::OK;
 }
 
-void CoasterPager::wait(const unsigned int timeout) const {
+OrderError CoasterPager::tryWait(const unsigned int timeout) const {
+    return tryWaitUntil(clock->now() + std::chrono::milliseconds(timeout));
+}
+
+void CoasterPager::wait_until(Clock::time_point deadline_in) const {
+    auto error = tryWaitUntil(deadline_in);
+    if(error != OrderError::ORDER_NOT_READY){
+        throw_on_error(error);
+    }
+}
+
+OrderError CoasterPager::tryWaitUntil(Clock::time_point deadline_in) const {
     std::unique_lock <std::mutex> lock(mutex_wait);
-    auto now = std::chrono::system_clock::now();
-    auto time_out = std::chrono::milliseconds(timeout);
-    cv_wait.wait_until(lock, now + time_out, [this]() { return is_ready; });
+    if(!clock->wait_until(cv_wait, lock, deadline_in, [this]() { return is_ready; })){
+        return OrderError::ORDER_NOT_READY;
+    }
     if(failed){
         taken = true;
-        throw FulfillmentFailure();
+        return OrderError::FULFILLMENT_FAILURE;
     }
+    return OrderError::OK;
+}
+
+std::unique_ptr<Product> CoasterPager::next() {
+    std::unique_ptr<Product> product;
+    throw_on_error(tryNext(product));
+    return product;
+}
+
+OrderError CoasterPager::tryNext(std::unique_ptr<Product> &product, Clock::time_point deadline_in) {
+    std::unique_lock <std::mutex> lock(mutex_wait);
+    if(!clock->wait_until(cv_wait, lock, deadline_in, [this]() { return is_ready || delivered < products.size(); })){
+        return OrderError::ORDER_NOT_READY;
+    }
+    if(failed){
+        taken = true;
+        return OrderError::FULFILLMENT_FAILURE;
+    }
+    if(expired){
+        return OrderError::ORDER_EXPIRED;
+    }
+    product = nullptr;
+    if(delivered < products.size()){
+        product = std::move(products[delivered++]);
+    }
+    bool all_taken = is_ready && delivered == products.size();
+    lock.unlock();
+
+    if(all_taken){
+        // klient ma juz wszystko - worker nie musi czekac na collectOrder(); jak w tryCollectOrders()
+        // czekamy, az worker pusci pager, bo klient moze go zniszczyc zaraz po tym wywolaniu
+        std::unique_lock<std::mutex> lock_taken(mutex_taken);
+        if(!expired){
+            // przeterminowane worker oznacza pod mutex_taken i juz na nas nie czeka
+            taken = true;
+            cv_taken.notify_all();
+            cv_taken.wait(lock_taken, [this]{return released;});
+        }
+    }
+    return OrderError::OK;
+}
+
+std::vector<std::string> CoasterPager::getFailedProducts() const {
+    std::unique_lock <std::mutex> lock(mutex_wait);
+    return failed_products;
 }
 
 unsigned int CoasterPager::getId() const {
@@ -45,13 +173,30 @@ bool CoasterPager::isReady() const {
     return is_ready;
 }
 
+Clock::time_point CoasterPager::getDeadline() const {
+    return deadline;
+}
+
+Clock::time_point CoasterPager::getPickupDeadline() const {
+    std::unique_lock <std::mutex> lock(mutex_wait);
+    return pickup_deadline;
+}
+
+Clock::time_point CoasterPager::now() const {
+    return clock->now();
+}
+
+Clock::time_point CoasterPager::estimatedReadyTime() const {
+    std::unique_lock <std::mutex> lock(mutex_wait);
+    return eta;
+}
+
 //***************************************************
 //**                  SYSTEM                       **
 //***************************************************
 
 
-void routine(const std::stop_token& stoken ,queue_t &queue_orders, std::shared_ptr<machines_t> machines, mutex_t
-&machines_mutexes, pojemnik &dane, unsigned int clientTimeout, Menu &menu, PendingOrders &pending_orders, std::vector<WorkerReport> &workers_reports) {
+void routine(const std::stop_token& stoken ,queue_t &queue_orders, Clock &clock, pojemnik &dane, unsigned int clientTimeout, FailurePolicy failurePolicy, Menu &menu, PendingOrders &pending_orders, std::vector<WorkerReport> &workers_reports) {
 
     WorkerReport workerReport;
 
@@ -66,48 +211,131 @@ void routine(const std::stop_token& stoken ,queue_t &queue_orders, std::shared_p
         }
 
         std::unique_lock<std::mutex> lock2(dane.queue_mutex);
-        auto current_order = queue_orders.front().first;
-        auto pager = queue_orders.front().second;
+        // lista produktow przechodzi przez kolejke, workera i raport bez kopiowania
+        auto current_order = std::move(queue_orders.front().first);
+        auto pager = std::move(queue_orders.front().second);
+
+        if(clock.now() > pager.deadline){
+            // termin klienta minal w kolejce - nie ma po co angazowac maszyn
+            for(auto & slot : pager.slots){
+                if(slot){
+                    slot->stats->dequeue();
+                }
+            }
+            queue_orders.pop(clock.now());
+            dane.length.fetch_sub(1, std::memory_order_relaxed);
+            lock2.unlock();
+            lock.unlock();
+            dane.cv_space.notify_one();
+
+            workerReport.failedOrders.push_back(std::move(current_order));
+            std::unique_lock<std::mutex> lock3(*pager.mutex_wait);
+            *pager.failed = true;
+            *pager.expired = true;
+            *pager.is_ready = true;
+            *pager.eta = clock.now();
+            // notify pod mutex_wait - nieudany pager klient (albo abandonOrder) moze od razu zniszczyc
+            (*pager.cv_wait).notify_all();
+            lock3.unlock();
+
+            pending_orders.remove_id(pager.id);
+            continue;
+        }
 
-        std::vector<std::pair<std::thread, std::string>> threads_lock;
+        std::vector<std::thread> threads_lock;
 
-        for(auto & food: current_order){
+        for(auto & slot : pager.slots){
             threads_lock.emplace_back(std::thread {[&]() {
-                machines_mutexes[food]->lock();
-            }}, food);
+                if(slot){
+                    slot->mutex->lock();
+                }
+            }});
+            if(slot){
+                slot->stats->dequeue();
+            }
         }
-        lock.unlock();
 
-        queue_orders.pop();
+        queue_orders.pop(clock.now());
+        dane.length.fetch_sub(1, std::memory_order_relaxed);
         lock2.unlock();
+        lock.unlock();
+        dane.cv_space.notify_one();
+
+        double service = 0;
+        for(auto & slot : pager.slots){
+            if(slot){
+                service = std::max(service, slot->stats->get_ewma());
+            }
+        }
+        std::unique_lock<std::mutex> lock_eta(*pager.mutex_wait);
+        *pager.eta = clock.now() + std::chrono::microseconds((long long) (service * 1000));
+        lock_eta.unlock();
 
         std::vector<std::thread> threads_order;
         std::vector<std::unique_ptr<Product>> products;
-        std::vector<std::string> foods;
+        std::vector<MachineSlot *> foods;
         bool if_execption = false;
         std::mutex m;
 
-        for(auto & thread: threads_lock){
-            threads_order.emplace_back(std::thread {[&]() {
-                thread.first.join();
-                std::string food = thread.second;
+        for(std::size_t i = 0;i < threads_lock.size();i++){
+            threads_order.emplace_back(std::thread {[&, i]() {
+                threads_lock[i].join();
+                const std::string &food = current_order[i];
+                const auto &slot = pager.slots[i];
 
                 std::unique_ptr<Product> produkt = nullptr;
 
+                if(slot == nullptr){
+                    // maszyne wycofano miedzy walidacja a przyjeciem zamowienia
+                    std::unique_lock<std::mutex> lock_failed(*pager.mutex_wait);
+                    pager.failed_products->push_back(food);
+                    lock_failed.unlock();
+                    if_execption = true;
+                    return;
+                }
+
+                if(slot->health->is_open()){
+                    // maszyna juz padla - nie czekamy na nia drugi raz
+                    slot->health->reject();
+                    std::unique_lock<std::mutex> lock_failed(*pager.mutex_wait);
+                    pager.failed_products->push_back(food);
+                    lock_failed.unlock();
+                    if_execption = true;
+                    slot->mutex->unlock();
+                    return;
+                }
+
                 try{
-                    auto product = (*machines)[food]->getProduct();
+                    auto start = clock.now();
+                    auto product = slot->machine->getProduct();
+                    slot->stats->record(std::chrono::duration<double, std::milli>(
+                            clock.now() - start).count());
 
                     std::unique_lock<std::mutex> lock(m);
                     produkt = std::move(product);
-                    products.push_back(std::move(produkt));
-                    foods.push_back(food);
-                    machines_mutexes[food]->unlock();
+                    if(pager.streaming){
+                        // produkt od razu trafia do klienta; products[k] w pagerze odpowiada foods[k]
+                        std::unique_lock<std::mutex> lock_stream(*pager.mutex_wait);
+                        pager.products->push_back(std::move(produkt));
+                        lock_stream.unlock();
+                        (*pager.cv_wait).notify_all();
+                    } else {
+                        products.push_back(std::move(produkt));
+                    }
+                    foods.push_back(slot.get());
+                    slot->mutex->unlock();
                     lock.unlock();
                 } catch(std::exception& error) {
-                    menu.remove_record(food);
+                    slot->health->record_failure();
+                    if(!slot->retired){
+                        menu.remove_record(food);
+                    }
+                    std::unique_lock<std::mutex> lock_failed(*pager.mutex_wait);
+                    pager.failed_products->push_back(food);
+                    lock_failed.unlock();
                     if_execption = true;
                     workerReport.failedProducts.push_back(food);
-                    machines_mutexes[food]->unlock();
+                    slot->mutex->unlock();
                 }
             }});
         }
@@ -116,102 +344,204 @@ void routine(const std::stop_token& stoken ,queue_t &queue_orders, std::shared_p
             thread.join();
         }
 
+        if(if_execption && failurePolicy == FailurePolicy::PARTIAL && !foods.empty()){
+            // cos sie udalo - zamowienie jest gotowe bez brakujacych produktow
+            if_execption = false;
+        }
+        if(if_execption && pager.streaming){
+            // wraca tylko to, czego klient jeszcze nie odebral (odebrane sa nullptr)
+            std::unique_lock<std::mutex> lock_stream(*pager.mutex_wait);
+            products = std::move(*pager.products);
+            pager.products->clear();
+        }
+
         if(if_execption){
-            workerReport.failedOrders.push_back(current_order);
-            std::atomic_uint it = 0;
-            for(const auto& food : foods){
-                if(products[it] != nullptr){
-                    machines_mutexes[food]->lock();
-                    (*machines)[food]->returnProduct(std::move(products[it]));
-                    it++;
-                    machines_mutexes[food]->unlock();
+            for(std::size_t k = 0;k < foods.size();k++){
+                if(products[k] != nullptr){
+                    foods[k]->mutex->lock();
+                    foods[k]->machine->returnProduct(std::move(products[k]));
+                    foods[k]->mutex->unlock();
                 }
             }
+            workerReport.failedOrders.push_back(std::move(current_order));
 
             std::unique_lock<std::mutex> lock3(*pager.mutex_wait);
             *pager.failed = true;
             *pager.is_ready = true;
+            *pager.eta = clock.now();
+            // jak wyzej - po zwolnieniu mutex_wait pager nieudanego zamowienia nie jest juz nasz
+            (*pager.cv_wait).notify_all();
             lock3.unlock();
-            (*pager.cv_wait).notify_one();
 
             pending_orders.remove_id(pager.id);
         } else {
             std::unique_lock<std::mutex> lock3(*pager.mutex_wait);
 
-            *pager.products = std::move(products);
+            if(!pager.streaming){
+                *pager.products = std::move(products);
+            }
             *pager.is_ready = true;
-            auto now = std::chrono::system_clock::now();
+            auto now = clock.now();
+            auto pickup_deadline = now + std::chrono::milliseconds(clientTimeout);
+            *pager.eta = now;
+            *pager.pickup_deadline = pickup_deadline;
             lock3.unlock();
-            (*pager.cv_wait).notify_one();
+            (*pager.cv_wait).notify_all();
 
             std::unique_lock<std::mutex> lock4(*pager.mutex_taken);
-            auto timeout = std::chrono::milliseconds(clientTimeout);
-            if((*pager.cv_taken).wait_until(lock4, now + timeout, [&]{return *pager.taken;})){
-                workerReport.collectedOrders.push_back(current_order);
+            if(clock.wait_until(*pager.cv_taken, lock4, pickup_deadline, [&]{return *pager.taken;})){
+                // notify pod mutex_taken - klient niszczy pager zaraz po tym, jak go zwolnimy
+                *pager.released = true;
+                (*pager.cv_taken).notify_all();
+                lock4.unlock();
+                workerReport.collectedOrders.push_back(std::move(current_order));
                 pending_orders.remove_id(pager.id);
             } else {
-                workerReport.abandonedOrders.push_back(current_order);
+                // klient strumieniowy moze akurat odbierac - zabieramy mu reszte pod mutex_wait
+                std::unique_lock<std::mutex> lock_expired(*pager.mutex_wait);
                 *pager.expired = true;
+                products = std::move(*pager.products);
+                pager.products->clear();
+                lock_expired.unlock();
                 pending_orders.remove_id(pager.id);
-                std::atomic_uint it = 0;
-                for(const auto& food : foods){
-                    if((*pager.products)[it] != nullptr){
-                        machines_mutexes[food]->lock();
-                        (*machines)[food]->returnProduct(std::move((*pager.products)[it]));
-                        it++;
-                        machines_mutexes[food]->unlock();
+                for(std::size_t k = 0;k < foods.size();k++){
+                    if(products[k] != nullptr){
+                        foods[k]->mutex->lock();
+                        foods[k]->machine->returnProduct(std::move(products[k]));
+                        foods[k]->mutex->unlock();
                     }
                 }
+                workerReport.abandonedOrders.push_back(std::move(current_order));
             }
         }
     }
     std::unique_lock<std::mutex> lock2(dane.order_mutex);
     workers_reports.emplace_back(std::move(workerReport));
-    dane.cv.notify_one();
+    dane.cv.notify_all();
+}
+
+
+void probe_routine(const std::stop_token& stoken, const table_t &machines, Menu &menu, Clock &clock,
+                   unsigned int probeInterval) {
+    std::mutex m;
+    std::condition_variable cv;
+    std::stop_callback wake(stoken, [&]{
+        std::lock_guard<std::mutex> lock(m);
+        cv.notify_all();
+    });
+
+    while(!stoken.stop_requested()) {
+        std::unique_lock<std::mutex> lock(m);
+        clock.wait_for(cv, lock, std::chrono::milliseconds(probeInterval), [&]{return stoken.stop_requested();});
+        lock.unlock();
+
+        if(stoken.stop_requested()){
+            break;
+        }
+
+        auto table = machines.load();
+        for(const auto& part : *table){
+            auto &slot = part.second;
+            if(!slot->health->try_probe()){
+                continue;
+            }
+
+            slot->mutex->lock();
+            try{
+                auto product = slot->machine->getProduct();
+                slot->machine->returnProduct(std::move(product));
+                if(slot->health->record_success() && !slot->retired && !menu.contains(part.first)){
+                    menu.add_record(part.first);
+                }
+            } catch(std::exception& error) {
+                slot->health->record_failure();
+            }
+            slot->mutex->unlock();
+        }
+    }
 }
 
 
-System::System(machines_t machines_in, unsigned int numberOfWorkers, unsigned int clientTimeout_in) :
-        machines(std::make_shared<machines_t>(std::move(machines_in))),
+System::System(machines_t machines_in, unsigned int numberOfWorkers_in, unsigned int clientTimeout_in,
+               SystemConfig config_in) :
+        config(config_in),
+        clock(config_in.clock ? config_in.clock : std::make_shared<RealClock>()),
         clientTimeout(clientTimeout_in),
+        numberOfWorkers(numberOfWorkers_in),
+        reported(false),
+        id(0),
+        closed(false),
+        rejected_orders(0),
+        queue_orders(config_in.tenantQuantum),
         pending_orders(),
         menu()
 {
-    closed = false;
-    id = 0;
 
-    for(const auto& part : *machines){
+    node = config.numaNode;
+    if(node < 0 && !config.workerCpus.empty()){
+        node = numa_node_of(config.workerCpus.front());
+    }
+
+    auto table = std::make_shared<machine_table_t>();
+    for(auto& part : machines_in){
         part.second->start();
-        machines_mutexes[part.first] = std::make_unique<FairMutex>();
+        (*table)[part.first] = makeSlot(part.first, std::move(part.second));
         menu.add_record(part.first);
     }
+    machines.store(std::move(table));
+
+    for(const auto& weight : config.tenantWeights){
+        queue_orders.set_weight(weight.first, weight.second);
+    }
 
     for(unsigned int i = 0;i < numberOfWorkers;i++){
 //        workers_reports.emplace_back();
         workers.emplace_back(std::jthread {[&](const std::stop_token& stoken){
-            routine(stoken, queue_orders, machines, machines_mutexes, std::ref(dane), clientTimeout, menu, pending_orders, workers_reports);
+            routine(stoken, queue_orders, *clock, std::ref(dane), clientTimeout, config.failurePolicy, menu, pending_orders, workers_reports);
         }});
+        if(!config.workerCpus.empty()){
+            pin_thread(workers.back().native_handle(), config.workerCpus[i % config.workerCpus.size()]);
+        }
+    }
+
+    if(config.probeInterval > 0){
+        prober = std::jthread {[&](const std::stop_token& stoken){
+            probe_routine(stoken, machines, menu, *clock, config.probeInterval);
+        }};
+        if(!config.workerCpus.empty()){
+            pin_thread(prober.native_handle(), config.workerCpus.front());
+        }
     }
 }
 
 std::vector<WorkerReport> System::shutdown() {
 
+    if(prober.joinable()){
+        prober.request_stop();
+        prober.join();
+    }
+
+    // closed pod machines_mutex - addMachine()/replaceMachine() sprawdzaja je pod tym samym muteksem,
+    // wiec kazda opublikowana maszyna jest w zatrzymywanej tablicy albo nie zostanie juz wlaczona
+    std::unique_lock<std::mutex> lock_machines(machines_mutex);
+    closed = true;
     menu.make_empty();
-    for(const auto& machine : *machines){
-        machine.second->stop();
+    for(const auto& part : *machines.load()){
+        part.second->machine->stop();
     }
+    lock_machines.unlock();
     std::unique_lock<std::mutex> lock(dane.order_mutex);
-    closed = true;
 
     for(auto & worker : workers){
         worker.request_stop();
     }
     dane.cv.notify_all();
+    dane.cv_space.notify_all();
     lock.unlock();
 
-    std::mutex m;
-    std::unique_lock<std::mutex> lock2(m);
-    dane.cv.wait(lock2, [&]{return workers.size() == workers_reports.size();});
+    std::unique_lock<std::mutex> lock2(dane.order_mutex);
+    dane.cv.wait(lock2, [&]{return reported || workers.size() == workers_reports.size();});
+    reported = true;
     lock2.unlock();
 
 //    for(auto &xd : workers_reports){
@@ -244,65 +574,290 @@ std::vector<WorkerReport> System::shutdown() {
 //
 //    }
 
-    return workers_reports;
+    // raporty oddajemy bez kopiowania - kolejne shutdown() zwraca juz pusta liste
+    return std::move(workers_reports);
 }
 
-std::unique_ptr<CoasterPager> System::order(std::vector<std::string> products){
-    if(!closed){
-        for(auto & food : products){
-            if(!menu.contains(food)){
-                throw BadOrderException();
+OrderError System::validateOrder(const std::vector<std::string> &products){
+    if(closed){
+        return OrderError::RESTAURANT_CLOSED;
+    }
+    for(auto & food : products){
+        auto slot = findSlot(food);
+        if(slot != nullptr && slot->health->is_open()){
+            slot->health->reject();
+            return OrderError::BAD_ORDER;
+        }
+    }
+    for(auto & food : products){
+        if(!menu.contains(food)){
+            return OrderError::BAD_ORDER;
+        }
+    }
+    if(products.empty()){return OrderError::BAD_ORDER;}
+    return OrderError::OK;
+}
+
+std::unique_lock<std::mutex> System::lockOrders(){
+    return std::unique_lock<std::mutex>(dane.order_mutex);
+}
+
+OrderError System::admitOrder(const std::vector<std::string> &products, std::unique_lock<std::mutex> &lock,
+                              bool may_block, Clock::time_point deadline, unsigned int tenant){
+    auto max = config.maxQueuedOrders;
+    bool full = max > 0 && queue_orders.size() >= max;
+
+    switch(config.admission) {
+        case AdmissionPolicy::UNBOUNDED:
+            full = false;
+            break;
+        case AdmissionPolicy::REJECT:
+            break;
+        case AdmissionPolicy::BLOCK:
+            if(full && may_block){
+                full = !clock->wait_until(dane.cv_space, lock, deadline,
+                                          [&]{return closed || queue_orders.size() < max;});
+            }
+            break;
+        case AdmissionPolicy::TIMEOUT:
+            if(full && may_block){
+                auto timeout = clock->now() + std::chrono::milliseconds(config.admissionTimeout);
+                full = !clock->wait_until(dane.cv_space, lock, std::min(timeout, deadline),
+                                          [&]{return closed || queue_orders.size() < max;});
+            }
+            break;
+        case AdmissionPolicy::SHED:
+            if(estimateWait(products) > config.maxEstimatedWait){
+                full = true;
             }
+            break;
+    }
+
+    if(closed){
+        return OrderError::RESTAURANT_CLOSED;
+    }
+    // limit tenanta obowiazuje przy kazdej polityce - nie czekamy na niego, bo zwalnia go tylko
+    // obsluga zamowien tego samego tenanta
+    if(config.maxQueuedPerTenant > 0 && queue_orders.size(tenant) >= config.maxQueuedPerTenant){
+        full = true;
+    }
+    if(full){
+        rejected_orders.fetch_add(1, std::memory_order_relaxed);
+        queue_orders.reject(tenant);
+        return OrderError::ORDER_REJECTED;
+    }
+    return OrderError::OK;
+}
+
+// Czas (ms) samego zrobienia zamowienia: najwolniejsza z jego maszyn.
+double System::estimateService(const std::vector<std::string> &products) const {
+    double service = 0;
+    for(auto & food : products){
+        auto slot = findSlot(food);
+        if(slot != nullptr){
+            service = std::max(service, slot->stats->get_ewma());
         }
-        if(products.empty()){throw BadOrderException();}
-        std::unique_lock<std::mutex> lock(dane.order_mutex);
-        pagers_data p_data{};
-        id++;
-        auto * coaster_pager =  new CoasterPager(id);
-        pending_orders.add_id(id);
-        auto result = std::unique_ptr<CoasterPager>(coaster_pager);
+    }
+    return service;
+}
+
+// Szacowany czas (ms) do zrobienia zamowienia: wolniejsze z czekania na maszyny (kolejka zamowien
+// do kazdej z nich, podzielona przez jej liczbe miejsc) i czekania na wolnego workera.
+double System::estimateWait(const std::vector<std::string> &products) const {
+    double wait = 0;
+    for(auto & food : products){
+        auto slot = findSlot(food);
+        if(slot != nullptr){
+            auto capacity = slot->mutex->capacity();
+            wait = std::max(wait, (slot->stats->get_queued() / capacity + 1) * slot->stats->get_ewma());
+        }
+    }
+    if(numberOfWorkers > 0){
+        auto ahead = dane.length.load(std::memory_order_relaxed) / numberOfWorkers;
+        wait = std::max(wait, (ahead + 1) * estimateService(products));
+    }
+    return wait;
+}
+
+// Wymaga trzymania dane.order_mutex (patrz lockOrders()).
+OrderError System::enqueueOrder(std::vector<std::string> products, std::unique_ptr<CoasterPager> &result,
+                                Clock::time_point deadline, unsigned int tenant, bool streaming){
+    if(closed){
+        return OrderError::RESTAURANT_CLOSED;
+    }
+    pagers_data p_data{};
+    unsigned int new_id = id.fetch_add(1, std::memory_order_relaxed) + 1;
+    auto * coaster_pager =  new CoasterPager(new_id, clock);
+    pending_orders.add_id(new_id);
+    result = std::unique_ptr<CoasterPager>(coaster_pager);
+    result->deadline = deadline;
+    result->streaming = streaming;
+
+    //branie referencji z coaster pagera
+    p_data.mutex_wait = &result->mutex_wait;
+    p_data.mutex_taken = &result->mutex_taken;
+
+    p_data.cv_wait = &result->cv_wait;
+    p_data.cv_taken = &result->cv_taken;
+
+    p_data.products = &result->products;
+    p_data.failed_products = &result->failed_products;
+    p_data.expired = &result->expired;
+    p_data.is_ready = &result->is_ready;
+    p_data.failed = &result->failed;
+    p_data.taken = &result->taken;
+    p_data.released = &result->released;
+    p_data.eta = &result->eta;
+    p_data.pickup_deadline = &result->pickup_deadline;
+    p_data.deadline = deadline;
+    p_data.ordered_at = clock->now();
+
+    p_data.id = result->id;
+    p_data.tenant = tenant;
+    p_data.streaming = streaming;
+    // koniec brania referencji
+
+    result->eta = clock->now() +
+            std::chrono::microseconds((long long) (estimateWait(products) * 1000));
+
+    // jedna migawka tablicy na cale zamowienie
+    auto table = machines.load();
+    for(auto & food : products){
+        auto slot = table->find(food);
+        p_data.slots.push_back(slot != table->end() ? slot->second : nullptr);
+        if(p_data.slots.back() != nullptr){
+            p_data.slots.back()->stats->enqueue();
+        }
+    }
+
+    queue_orders.push(std::make_pair(std::move(products), std::move(p_data)));
+    dane.length.fetch_add(1, std::memory_order_relaxed);
+    return OrderError::OK;
+}
+
+void System::notifyWorkers(){
+    dane.cv.notify_one();
+}
 
-        //branie referencji z coaster pagera
-        p_data.mutex_wait = &result->mutex_wait;
-        p_data.mutex_taken = &result->mutex_taken;
+std::unique_ptr<CoasterPager> System::order(std::vector<std::string> products){
+    std::unique_ptr<CoasterPager> result;
+    throw_on_error(tryOrder(std::move(products), result));
+    return result;
+}
 
-        p_data.cv_wait = &result->cv_wait;
-        p_data.cv_taken = &result->cv_taken;
+std::unique_ptr<CoasterPager> System::order(std::vector<std::string> products, Clock::time_point deadline){
+    std::unique_ptr<CoasterPager> result;
+    throw_on_error(tryOrder(std::move(products), result, deadline));
+    return result;
+}
 
-        p_data.products = &result->products;
-        p_data.expired = &result->expired;
-        p_data.is_ready = &result->is_ready;
-        p_data.failed = &result->failed;
-        p_data.taken = &result->taken;
+std::unique_ptr<CoasterPager> System::orderStream(std::vector<std::string> products, Clock::time_point deadline,
+                                                 unsigned int tenant){
+    std::unique_ptr<CoasterPager> result;
+    throw_on_error(tryOrder(std::move(products), result, deadline, tenant, true));
+    return result;
+}
 
-        p_data.id = result->id;
-        // koniec brania referencji
+std::unique_ptr<CoasterPager> System::order(unsigned int tenant, std::vector<std::string> products){
+    std::unique_ptr<CoasterPager> result;
+    throw_on_error(tryOrder(std::move(products), result, Clock::time_point::max(), tenant));
+    return result;
+}
 
-        queue_orders.push(std::make_pair(std::move(products), p_data));
-        lock.unlock();
-        dane.cv.notify_one();
-//
-        return result;
-    } else {
-        throw RestaurantClosedException();
+OrderError System::tryOrder(std::vector<std::string> products, std::unique_ptr<CoasterPager> &result,
+                            Clock::time_point deadline, unsigned int tenant, bool streaming){
+    auto error = validateOrder(products);
+    if(error != OrderError::OK){
+        return error;
     }
 
+    auto lock = lockOrders();
+    error = admitOrder(products, lock, true, deadline, tenant);
+    if(error == OrderError::OK){
+        error = enqueueOrder(std::move(products), result, deadline, tenant, streaming);
+    }
+    lock.unlock();
+    if(error == OrderError::OK){
+        notifyWorkers();
+    }
+
+    return error;
 }
 
 std::vector<std::unique_ptr<Product>> System::collectOrder(std::unique_ptr<CoasterPager> CoasterPager) {
-    if(CoasterPager->failed){throw FulfillmentFailure();}
-    if(!CoasterPager->isReady()){throw OrderNotReadyException();}
-    if(CoasterPager->taken){throw BadOrderException();}
-    if(CoasterPager->expired){throw OrderExpiredException();}
-
-//    CoasterPager->wait();
-    std::unique_lock<std::mutex> lock(CoasterPager->mutex_taken);
-    CoasterPager->taken = true;
-    lock.unlock();
-    (CoasterPager->cv_taken).notify_one();
-//    std::cerr << "XAXAX\n";
+    std::vector<std::unique_ptr<Product>> result;
+    throw_on_error(tryCollectOrder(CoasterPager, result));
+    return result;
+}
+
+OrderError System::tryCollectOrder(std::unique_ptr<CoasterPager> &CoasterPager,
+                                   std::vector<std::unique_ptr<Product>> &result) {
+    return tryCollectOrders({&CoasterPager}, result);
+}
+
+OrderError System::tryCollectOrders(const std::vector<std::unique_ptr<CoasterPager>*> &pagers,
+                                    std::vector<std::unique_ptr<Product>> &result) {
+    for(auto pager : pagers){
+        if(*pager == nullptr){return OrderError::BAD_PAGER;}
+    }
+    // failed i is_ready worker ustawia pod mutex_wait
+    for(auto pager : pagers){
+        std::lock_guard<std::mutex> lock_wait((*pager)->mutex_wait);
+        if((*pager)->failed){return OrderError::FULFILLMENT_FAILURE;}
+    }
+    for(auto pager : pagers){
+        std::lock_guard<std::mutex> lock_wait((*pager)->mutex_wait);
+        if(!(*pager)->is_ready){return OrderError::ORDER_NOT_READY;}
+        if((*pager)->taken){return OrderError::BAD_ORDER;}
+    }
+
+    // worker oznacza zamowienie jako przeterminowane pod mutex_taken - trzymajac wszystkie naraz
+    // wiemy, ze zadna czesc nie przepadnie, zanim oznaczymy odbior calosci
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for(auto pager : pagers){
+        locks.emplace_back((*pager)->mutex_taken);
+        if((*pager)->expired){return OrderError::ORDER_EXPIRED;}
+    }
+    for(auto pager : pagers){
+        (*pager)->taken = true;
+    }
+    locks.clear();
+
+    for(auto pager : pagers){
+        // worker budzi sie na mutex_taken i cv_taken pagera - czekamy, az je zwolni, zanim pager zniszczymy
+        std::unique_lock<std::mutex> lock_taken((*pager)->mutex_taken);
+        ((*pager)->cv_taken).notify_all();
+        ((*pager)->cv_taken).wait(lock_taken, [pager]{return (*pager)->released;});
+        lock_taken.unlock();
+        for(auto & product : (*pager)->products){
+            // produkty odebrane wczesniej przez next() zostawiaja puste miejsca
+            if(product != nullptr){
+                result.push_back(std::move(product));
+            }
+        }
+        pager->reset();
+    }
+    return OrderError::OK;
+}
 
-    return std::move(CoasterPager->products);
+void System::abandonOrder(std::unique_ptr<CoasterPager> pager) {
+    // worker konczy z pagerem, gdy oznaczy go jako nieudany (pod mutex_wait), przeterminowany
+    // albo odebrany (pod mutex_taken) - dopiero wtedy pager mozna zwolnic
+    auto finished = [](const std::unique_ptr<CoasterPager> &old){
+        std::unique_lock<std::mutex> lock_wait(old->mutex_wait);
+        if(old->failed){
+            return true;
+        }
+        lock_wait.unlock();
+        std::lock_guard<std::mutex> lock_taken(old->mutex_taken);
+        return old->expired || old->released;
+    };
+
+    std::lock_guard<std::mutex> lock(abandoned_mutex);
+    std::erase_if(abandoned, finished);
+    if(pager != nullptr && !finished(pager)){
+        abandoned.push_back(std::move(pager));
+    }
 }
 
 std::vector<unsigned int> System::getPendingOrders() const {
@@ -315,4 +870,112 @@ std::vector<std::string> System::getMenu() const {
 
 unsigned int System::getClientTimeout() const {
     return clientTimeout;
-}
\ No newline at end of file
+}
+
+std::vector<MachineHealthReport> System::getMachinesHealth() const {
+    std::vector<MachineHealthReport> result;
+    for(const auto& part : *machines.load()){
+        auto &health = part.second->health;
+        result.push_back({part.first, health->get_state(), health->get_failures(), health->get_rejected()});
+    }
+    return result;
+}
+
+unsigned int System::getRejectedOrders() const {
+    return rejected_orders.load(std::memory_order_relaxed);
+}
+
+std::shared_ptr<Clock> System::getClock() const {
+    return clock;
+}
+
+std::chrono::milliseconds System::estimateOrder(const std::vector<std::string> &products) const {
+    return std::chrono::milliseconds((long long) estimateWait(products));
+}
+
+std::vector<MachineLatencyReport> System::getMachinesLatency() const {
+    std::vector<MachineLatencyReport> result;
+    for(const auto& part : *machines.load()){
+        auto &stats = part.second->stats;
+        result.push_back({part.first, stats->get_ewma(), stats->get_quantile(0.5), stats->get_quantile(0.99),
+                          stats->get_queued()});
+    }
+    return result;
+}
+
+std::vector<TenantReport> System::getTenantsReport() {
+    auto lock = lockOrders();
+    return queue_orders.report();
+}
+
+std::vector<MachineContentionReport> System::getMachinesContention() const {
+    std::vector<MachineContentionReport> result;
+    for(const auto& part : *machines.load()){
+        result.push_back({part.first, part.second->mutex->profile()});
+    }
+    return result;
+}
+
+std::shared_ptr<MachineSlot> System::makeSlot(const std::string &name, std::shared_ptr<Machine> machine) const {
+    auto capacity = config.machineCapacity.find(name);
+    return std::make_shared<MachineSlot>(name, std::move(machine), node,
+                                         capacity != config.machineCapacity.end() ? capacity->second : 1u);
+}
+
+std::shared_ptr<MachineSlot> System::findSlot(const std::string &name) const {
+    auto table = machines.load();
+    auto slot = table->find(name);
+    return slot != table->end() ? slot->second : nullptr;
+}
+
+bool System::addMachine(const std::string &name, std::shared_ptr<Machine> machine) {
+    std::unique_lock<std::mutex> lock(machines_mutex);
+    auto table = machines.load();
+    if(closed || table->contains(name)){
+        return false;
+    }
+
+    machine->start();
+    auto next = std::make_shared<machine_table_t>(*table);
+    (*next)[name] = makeSlot(name, std::move(machine));
+    machines.store(std::move(next));
+    menu.add_record(name);
+    return true;
+}
+
+bool System::replaceMachine(const std::string &name, std::shared_ptr<Machine> machine) {
+    std::unique_lock<std::mutex> lock(machines_mutex);
+    auto table = machines.load();
+    auto old = table->find(name);
+    if(closed || old == table->end()){
+        return false;
+    }
+
+    machine->start();
+    auto next = std::make_shared<machine_table_t>(*table);
+    (*next)[name] = makeSlot(name, std::move(machine));
+    // stara maszyna zatrzyma sie, gdy skoncza sie przypiete do niej zamowienia
+    old->second->retired = true;
+    machines.store(std::move(next));
+    if(!menu.contains(name)){
+        menu.add_record(name);
+    }
+    return true;
+}
+
+bool System::retireMachine(const std::string &name) {
+    std::unique_lock<std::mutex> lock(machines_mutex);
+    auto table = machines.load();
+    auto old = table->find(name);
+    if(closed || old == table->end()){
+        return false;
+    }
+
+    // najpierw menu - nowe zamowienia z tym produktem nie przejda walidacji
+    menu.remove_record(name);
+    auto next = std::make_shared<machine_table_t>(*table);
+    next->erase(name);
+    old->second->retired = true;
+    machines.store(std::move(next));
+    return true;
+}
@@ -10,21 +10,148 @@
 #include <unordered_map>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <mutex>
 #include <functional>
 #include <future>
+#include <atomic>
+#include <condition_variable>
+#include <new>
+#include <algorithm>
 #include "machine.hpp"
 
+#if defined(CYRK_NUMA) && __has_include(<numa.h>)
+#include <numa.h>
+#define CYRK_HAVE_NUMA 1
+#else
+#define CYRK_HAVE_NUMA 0
+#endif
+
+// -DCYRK_PROFILE wlacza liczniki rywalizacji w FairMutex; bez niego profil jest zawsze pusty.
+#ifdef CYRK_PROFILE
+#define CYRK_HAVE_PROFILE 1
+#else
+#define CYRK_HAVE_PROFILE 0
+#endif
+
+//***************************************************
+//**               PLACEMENT                       **
+//***************************************************
+
+inline constexpr std::size_t cache_line = 64;
+
+// Przypina watek do podanego zbioru procesorow (pusty zbior - bez zmian).
+void pin_thread(std::thread::native_handle_type handle, const std::vector<int> &cpus);
+
+// Wezel NUMA pierwszego procesora ze zbioru albo -1 (brak libnuma / pusty zbior).
+int numa_node_of(const std::vector<int> &cpus);
+
+template<typename T>
+struct NodeDeleter {
+    void operator()(T *ptr) const
+    {
+#if CYRK_HAVE_NUMA
+        if(on_node){
+            ptr->~T();
+            numa_free(ptr, sizeof(T));
+            return;
+        }
+#endif
+        delete ptr;
+    }
+    bool on_node = false;
+};
+
+template<typename T>
+using node_ptr = std::unique_ptr<T, NodeDeleter<T>>;
+
+// Alokuje obiekt w pamieci wezla `node` (bez libnuma lub dla node < 0 zwykle new).
+template<typename T, typename... Args>
+node_ptr<T> make_on_node(int node, Args&&... args)
+{
+#if CYRK_HAVE_NUMA
+    if(node >= 0 && numa_available() >= 0){
+        void *memory = numa_alloc_onnode(sizeof(T), node);
+        if(memory != nullptr){
+            return node_ptr<T>(new (memory) T(std::forward<Args>(args)...), NodeDeleter<T>{true});
+        }
+    }
+#endif
+    (void) node;
+    return node_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+//***************************************************
+//**               CLOCK                           **
+//***************************************************
+
+// Zrodlo czasu dla Systemu - wszystkie oczekiwania z limitem czasu ida przez nie,
+// wiec w symulacji (VirtualClock, simulation.hpp) czas moze byc wirtualny.
+class Clock {
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+    typedef std::chrono::steady_clock::duration duration;
+
+    virtual ~Clock() = default;
+
+    virtual time_point now() const = 0;
+
+    // Czeka na cv (z zalozona blokada), az pred() albo minie deadline; zwraca pred().
+    virtual bool wait_until(std::condition_variable &cv, std::unique_lock<std::mutex> &lock,
+                            time_point deadline, const std::function<bool()> &pred) = 0;
+
+    virtual void sleep_until(time_point deadline) = 0;
+
+    bool wait_for(std::condition_variable &cv, std::unique_lock<std::mutex> &lock,
+                  duration timeout, const std::function<bool()> &pred)
+    {
+        return wait_until(cv, lock, now() + timeout, pred);
+    }
+
+    void sleep_for(duration timeout)
+    {
+        sleep_until(now() + timeout);
+    }
+};
+
+class RealClock : public Clock {
+public:
+    time_point now() const override
+    {
+        return std::chrono::steady_clock::now();
+    }
+
+    bool wait_until(std::condition_variable &cv, std::unique_lock<std::mutex> &lock,
+                    time_point deadline, const std::function<bool()> &pred) override
+    {
+        if (deadline == time_point::max()) {
+            cv.wait(lock, pred);
+            return true;
+        }
+        return cv.wait_until(lock, deadline, pred);
+    }
+
+    void sleep_until(time_point deadline) override
+    {
+        std::this_thread::sleep_until(deadline);
+    }
+};
+
 //***************************************************
 //**               STRUCTS                         **
 //***************************************************
 
-struct pojemnik{
+struct alignas(cache_line) pojemnik{
     std::condition_variable cv;
+    std::condition_variable cv_space;
     std::mutex queue_mutex;
     std::mutex order_mutex;
+    // dlugosc kolejki do czytania bez blokady (estimateOrder)
+    std::atomic<unsigned int> length{0};
 };
 
+struct MachineSlot;
+
 struct pagers_data{
     std::condition_variable *cv_taken;
     std::condition_variable *cv_wait;
@@ -33,12 +160,24 @@ struct pagers_data{
     std::mutex *mutex_taken;
 
     std::vector<std::unique_ptr<Product>> *products;
+    std::vector<std::string> *failed_products;
     bool *is_ready;
     bool *failed;
     bool *taken;
+    bool *released;
     bool *expired;
+    Clock::time_point *eta;
+    Clock::time_point *pickup_deadline;
+
+    Clock::time_point deadline;
+    Clock::time_point ordered_at;
 
     unsigned int id;
+    unsigned int tenant;
+    bool streaming;
+
+    // maszyny produktow (slots[i] robi products[i]) przypiete na czas zamowienia; nullptr - maszyny juz nie ma
+    std::vector<std::shared_ptr<MachineSlot>> slots;
 };
 
 
@@ -46,11 +185,11 @@ struct pagers_data{
 //**               STRUCTS                         **
 //***************************************************
 
-class Menu {
+class alignas(cache_line) Menu {
 public:
     Menu() = default;
 
-    bool contains(std::string record){
+    bool contains(const std::string &record){
         m.lock();
         bool check = false;
         for(auto & r: menu){
@@ -60,13 +199,13 @@ public:
         return check;
     }
 
-    void remove_record(std::string record){
+    void remove_record(const std::string &record){
         m.lock();
         erase(menu, record);
         m.unlock();
     }
 
-    void add_record(std::string record){
+    void add_record(const std::string &record){
         m.lock();
         menu.push_back(record);
         m.unlock();
@@ -80,7 +219,7 @@ public:
     std::mutex m;
 };
 
-class PendingOrders {
+class alignas(cache_line) PendingOrders {
 public:
     PendingOrders() = default;
 
@@ -101,18 +240,181 @@ public:
 };
 
 
+//***************************************************
+//**               FAIR QUEUE                      **
+//***************************************************
+
+struct TenantReport
+{
+    unsigned int tenant;
+    unsigned int queuedOrders;
+    unsigned int acceptedOrders;
+    unsigned int rejectedOrders;
+    unsigned int servedOrders;
+    double avgQueueMs;
+    double maxQueueMs;
+};
+
+// Kolejka zamowien z deficit round robin miedzy klientami (tenantami): kazdy aktywny tenant
+// dostaje w rundzie quantum * waga produktow, wiec jeden zasypujacy nas sklep nie zaglodzi reszty.
+// Dla jednego tenanta zwykla kolejka FIFO. Wymaga zewnetrznej synchronizacji (dane.order_mutex).
+class FairQueue {
+public:
+    typedef std::pair<std::vector<std::string>, pagers_data> entry_t;
+
+    explicit FairQueue(unsigned int quantum_in = 4) : quantum(quantum_in > 0 ? quantum_in : 1), count(0) {}
+
+    void set_weight(unsigned int tenant, unsigned int weight)
+    {
+        tenants[tenant].weight = weight > 0 ? weight : 1;
+    }
+
+    void push(entry_t entry)
+    {
+        auto &t = tenants[entry.second.tenant];
+        if (t.orders.empty())
+            active.push_back(entry.second.tenant);
+        t.accepted++;
+        auto cost = entry.first.size();
+        t.orders.emplace(cost, std::move(entry));
+        count++;
+    }
+
+    bool empty() const { return count == 0; }
+    std::size_t size() const { return count; }
+
+    std::size_t size(unsigned int tenant) const
+    {
+        auto t = tenants.find(tenant);
+        return t == tenants.end() ? 0 : t->second.orders.size();
+    }
+
+    // Nastepne zamowienie wedlug DRR; wolac tylko dla niepustej kolejki.
+    entry_t &front()
+    {
+        while (true) {
+            auto &t = tenants[active.front()];
+            if (t.deficit >= t.orders.front().first)
+                return t.orders.front().second;
+            t.deficit += quantum * t.weight;
+            active.push_back(active.front());
+            active.pop_front();
+        }
+    }
+
+    // Koszt zamowienia jest zapamietany przy push, wiec front() moze zwrocic wpis do przeniesienia.
+    void pop(Clock::time_point now)
+    {
+        front();
+        auto &t = tenants[active.front()];
+        double waited = std::chrono::duration<double, std::milli>(now - t.orders.front().second.second.ordered_at).count();
+        t.total_ms += waited;
+        t.max_ms = std::max(t.max_ms, waited);
+        t.served++;
+        t.deficit -= t.orders.front().first;
+        t.orders.pop();
+        count--;
+        if (t.orders.empty()) {
+            t.deficit = 0;
+            active.pop_front();
+        }
+    }
+
+    void reject(unsigned int tenant)
+    {
+        tenants[tenant].rejected++;
+    }
+
+    std::vector<TenantReport> report() const
+    {
+        std::vector<TenantReport> result;
+        for (const auto &t : tenants) {
+            result.push_back({t.first, (unsigned int) t.second.orders.size(), t.second.accepted, t.second.rejected,
+                              t.second.served, t.second.served ? t.second.total_ms / t.second.served : 0,
+                              t.second.max_ms});
+        }
+        return result;
+    }
+
+private:
+    struct tenant_t {
+        // (koszt = liczba produktow, zamowienie)
+        std::queue<std::pair<std::size_t, entry_t>> orders;
+        std::size_t deficit = 0;
+        unsigned int weight = 1;
+        unsigned int accepted = 0;
+        unsigned int rejected = 0;
+        unsigned int served = 0;
+        double total_ms = 0;
+        double max_ms = 0;
+    };
+
+    const unsigned int quantum;
+    std::unordered_map<unsigned int, tenant_t> tenants;
+    std::deque<unsigned int> active;
+    std::size_t count;
+};
+
 //***************************************************
 //**               FAIR MUTEX                      **
 //***************************************************
 
 
-class FairMutex {
-    std::mutex mutex;
+struct MutexProfile
+{
+    unsigned long long acquisitions;
+    double totalWaitMs;
+    double maxWaitMs;
+    // ile biletow (trzymajacych i czekajacych) bylo przed nami w chwili lock()
+    double avgQueueLength;
+    unsigned int maxQueueLength;
+    double totalHoldMs;
+    // przy capacity > 1 przyblizony - zwolnienia przypisujemy biletom po kolei
+    double maxHoldMs;
+};
+
+// Sprawiedliwy (FIFO) semafor; dla capacity == 1 zwykly mutex.
+class alignas(cache_line) FairMutex {
+    mutable std::mutex mutex;
     std::condition_variable cv_;
     unsigned int next_, curr_;
+    const unsigned int capacity_;
+
+#if CYRK_HAVE_PROFILE
+    typedef std::chrono::steady_clock profile_clock;
+
+    // wszystko pod `mutex`
+    MutexProfile profile_{};
+    unsigned long long queue_total_ = 0;
+    std::deque<profile_clock::time_point> held_since_;
+
+    void record_acquire(profile_clock::time_point start, unsigned int ahead)
+    {
+        auto now = profile_clock::now();
+        double waited = std::chrono::duration<double, std::milli>(now - start).count();
+        profile_.acquisitions++;
+        profile_.totalWaitMs += waited;
+        profile_.maxWaitMs = std::max(profile_.maxWaitMs, waited);
+        queue_total_ += ahead;
+        profile_.maxQueueLength = std::max(profile_.maxQueueLength, ahead);
+        held_since_.push_back(now);
+    }
+
+    void record_release()
+    {
+        if (held_since_.empty())
+            return;
+        double held = std::chrono::duration<double, std::milli>(profile_clock::now() - held_since_.front()).count();
+        held_since_.pop_front();
+        profile_.totalHoldMs += held;
+        profile_.maxHoldMs = std::max(profile_.maxHoldMs, held);
+    }
+#endif
 
 public:
-    FairMutex() : next_(0), curr_(0) {}
+    static constexpr bool profiled = CYRK_HAVE_PROFILE;
+
+    explicit FairMutex(unsigned int capacity = 1) : next_(0), curr_(0), capacity_(capacity > 0 ? capacity : 1) {}
     ~FairMutex() = default;
 
     FairMutex(const FairMutex&) = delete;
@@ -120,15 +422,29 @@ public:
 
     void lock()
     {
+#if CYRK_HAVE_PROFILE
+        auto start = profile_clock::now();
+#endif
         std::unique_lock<std::mutex> lk(mutex);
         const unsigned int self = next_++;
-        cv_.wait(lk, [&]{ return (self == curr_); });
+#if CYRK_HAVE_PROFILE
+        const unsigned int ahead = self - curr_;
+#endif
+        // roznica ze znakiem - przy capacity > 1 bilety moga byc zwalniane nie po kolei,
+        // wiec curr_ potrafi przegonic czekajacy bilet
+        cv_.wait(lk, [&]{ return static_cast<int>(self - curr_) < static_cast<int>(capacity_); });
+#if CYRK_HAVE_PROFILE
+        record_acquire(start, ahead);
+#endif
     }
     bool try_lock()
     {
         std::lock_guard<std::mutex> lk(mutex);
-        if (next_ != curr_)
+        if (static_cast<int>(next_ - curr_) >= static_cast<int>(capacity_))
             return false;
+#if CYRK_HAVE_PROFILE
+        record_acquire(profile_clock::now(), next_ - curr_);
+#endif
         ++next_;
         return true;
     }
@@ -136,8 +452,191 @@ public:
     {
         std::lock_guard<std::mutex> lk(mutex);
         ++curr_;
+#if CYRK_HAVE_PROFILE
+        record_release();
+#endif
         cv_.notify_all();
     }
+    unsigned int capacity() const { return capacity_; }
+
+    // Zerowy profil, gdy skompilowano bez CYRK_PROFILE.
+    MutexProfile profile() const
+    {
+#if CYRK_HAVE_PROFILE
+        std::lock_guard<std::mutex> lk(mutex);
+        auto result = profile_;
+        result.avgQueueLength = result.acquisitions ? (double) queue_total_ / result.acquisitions : 0;
+        return result;
+#else
+        return MutexProfile{};
+#endif
+    }
+};
+
+//***************************************************
+//**               MACHINE HEALTH                  **
+//***************************************************
+
+enum class HealthState { CLOSED, OPEN, HALF_OPEN };
+
+class alignas(cache_line) MachineHealth {
+    std::atomic<HealthState> state;
+    std::atomic<unsigned int> failures;
+    std::atomic<unsigned int> rejected;
+
+public:
+    MachineHealth() : state(HealthState::CLOSED), failures(0), rejected(0) {}
+    ~MachineHealth() = default;
+
+    MachineHealth(const MachineHealth&) = delete;
+    MachineHealth& operator=(const MachineHealth&) = delete;
+
+    // Maszyna otwarta lub probowana - zamowienia nie powinny jej dotykac.
+    bool is_open() const
+    {
+        return state.load(std::memory_order_acquire) != HealthState::CLOSED;
+    }
+    // Zamyka bezpiecznik po udanej probie. Udane zamowienie go nie zamyka - przy kilku
+    // naraz inne moglo wlasnie padac, a produkt wraca do menu tylko przez probe.
+    bool record_success()
+    {
+        HealthState expected = HealthState::HALF_OPEN;
+        return state.compare_exchange_strong(expected, HealthState::CLOSED);
+    }
+    void record_failure()
+    {
+        failures++;
+        state.store(HealthState::OPEN, std::memory_order_release);
+    }
+    bool try_probe()
+    {
+        HealthState expected = HealthState::OPEN;
+        return state.compare_exchange_strong(expected, HealthState::HALF_OPEN);
+    }
+    void reject()
+    {
+        rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+    HealthState get_state() const { return state.load(); }
+    unsigned int get_failures() const { return failures.load(); }
+    unsigned int get_rejected() const { return rejected.load(); }
+};
+
+//***************************************************
+//**               MACHINE STATS                   **
+//***************************************************
+
+class alignas(cache_line) MachineStats {
+    static constexpr std::size_t max_samples = 256;
+
+    std::atomic<double> ewma_ms;
+    std::atomic<unsigned int> queued;
+
+    mutable std::mutex samples_mutex;
+    std::vector<double> samples;
+    std::size_t next_sample;
+
+public:
+    MachineStats() : ewma_ms(0), queued(0), next_sample(0) {}
+    ~MachineStats() = default;
+
+    MachineStats(const MachineStats&) = delete;
+    MachineStats& operator=(const MachineStats&) = delete;
+
+    void record(double ms)
+    {
+        double old = ewma_ms.load(std::memory_order_relaxed);
+        double next;
+        do {
+            next = old == 0 ? ms : old + (ms - old) / 8;
+        } while(!ewma_ms.compare_exchange_weak(old, next, std::memory_order_relaxed));
+
+        std::lock_guard<std::mutex> lk(samples_mutex);
+        if (samples.size() < max_samples)
+            samples.push_back(ms);
+        else
+            samples[next_sample] = ms;
+        next_sample = (next_sample + 1) % max_samples;
+    }
+    // Liczba zamowien w kolejce, ktore potrzebuja tej maszyny.
+    void enqueue() { queued.fetch_add(1, std::memory_order_relaxed); }
+    void dequeue() { queued.fetch_sub(1, std::memory_order_relaxed); }
+
+    double get_ewma() const { return ewma_ms.load(std::memory_order_relaxed); }
+    unsigned int get_queued() const { return queued.load(std::memory_order_relaxed); }
+
+    // Kwantyl q (0..1) z ostatnich max_samples czasow getProduct(); 0, gdy brak pomiarow.
+    double get_quantile(double q) const
+    {
+        std::vector<double> copy;
+        {
+            std::lock_guard<std::mutex> lk(samples_mutex);
+            copy = samples;
+        }
+        if (copy.empty())
+            return 0;
+        auto nth = copy.begin() + static_cast<std::ptrdiff_t>(q * (copy.size() - 1));
+        std::nth_element(copy.begin(), nth, copy.end());
+        return *nth;
+    }
+};
+
+struct MachineLatencyReport
+{
+    std::string name;
+    double ewmaMs;
+    double p50Ms;
+    double p99Ms;
+    unsigned int queuedOrders;
+};
+
+struct MachineContentionReport
+{
+    std::string name;
+    MutexProfile profile;
+};
+
+//***************************************************
+//**               MACHINE TABLE                   **
+//***************************************************
+
+// Stan jednej maszyny. Tablica maszyn jest publikowana w stylu RCU: zmiana to nowa kopia tablicy,
+// a czytelnicy biora migawke bez blokady. Zamowienie trzyma sloty swoich produktow od przyjecia
+// do konca realizacji, wiec wymieniona lub wycofana maszyna dokancza przyjete juz zamowienia
+// i zatrzymuje ja dopiero ostatnie z nich.
+struct MachineSlot
+{
+    MachineSlot(std::string name_in, std::shared_ptr<Machine> machine_in, int node, unsigned int capacity) :
+            name(std::move(name_in)),
+            machine(std::move(machine_in)),
+            mutex(make_on_node<FairMutex>(node, capacity)),
+            health(make_on_node<MachineHealth>(node)),
+            stats(make_on_node<MachineStats>(node)) {}
+
+    ~MachineSlot()
+    {
+        if (retired)
+            machine->stop();
+    }
+
+    const std::string name;
+    const std::shared_ptr<Machine> machine;
+    const node_ptr<FairMutex> mutex;
+    const node_ptr<MachineHealth> health;
+    const node_ptr<MachineStats> stats;
+
+    // usunieta z tablicy - zatrzymywana przy zwolnieniu slotu
+    std::atomic<bool> retired{false};
+};
+
+typedef std::unordered_map<std::string, std::shared_ptr<MachineSlot>> machine_table_t;
+
+struct MachineHealthReport
+{
+    std::string name;
+    HealthState state;
+    unsigned int failures;
+    unsigned int rejectedOrders;
 };
 
 //***************************************************
@@ -168,6 +667,29 @@ class RestaurantClosedException : public std::exception
 {
 };
 
+class OrderRejectedException : public std::exception
+{
+};
+
+//***************************************************
+//**               ERROR CODES                     **
+//***************************************************
+
+// Odpowiedniki wyjatkow dla sciezek bez wyjatkow (tryOrder, tryCollectOrder, tryWait).
+enum class OrderError {
+    OK,
+    FULFILLMENT_FAILURE,
+    ORDER_NOT_READY,
+    BAD_ORDER,
+    BAD_PAGER,
+    ORDER_EXPIRED,
+    RESTAURANT_CLOSED,
+    ORDER_REJECTED
+};
+
+// Rzuca wyjatek odpowiadajacy kodowi (dla OK nic nie robi).
+void throw_on_error(OrderError error);
+
 //***************************************************
 //**                  WORKER REPORT                **
 //***************************************************
@@ -188,20 +710,53 @@ class CoasterPager
 {
 public:
     typedef std::unordered_map<std::string, std::shared_ptr<Machine>> machines_t;
-    typedef std::unordered_map<std::string, std::unique_ptr<FairMutex>> mutex_t;
-    typedef std::queue<std::pair<std::vector<std::string>, pagers_data>> queue_t;
+    typedef std::unordered_map<std::string, node_ptr<FairMutex>> mutex_t;
+    typedef FairQueue queue_t;
 
     void wait() const;
 
     void wait(unsigned int timeout) const;
 
+    [[nodiscard]] OrderError tryWait() const;
+
+    // ORDER_NOT_READY, jesli zamowienie nie zdazylo w `timeout` ms.
+    [[nodiscard]] OrderError tryWait(unsigned int timeout) const;
+
+    // Jak wait(timeout), ale z bezwzglednym terminem na zegarze Systemu.
+    void wait_until(Clock::time_point deadline) const;
+
+    [[nodiscard]] OrderError tryWaitUntil(Clock::time_point deadline) const;
+
+    // Kolejny gotowy produkt zamowienia, w kolejnosci produkcji; nullptr, gdy wszystkie juz odebrano.
+    // W zamowieniu strumieniowym (System::orderStream) produkty przychodza od razu po zrobieniu,
+    // w zwyklym - wszystkie naraz, gdy zamowienie jest gotowe.
+    std::unique_ptr<Product> next();
+
+    // ORDER_NOT_READY, jesli do `deadline` nie pojawil sie kolejny produkt.
+    [[nodiscard]] OrderError tryNext(std::unique_ptr<Product> &product,
+                                     Clock::time_point deadline = Clock::time_point::max());
+
+    // Produkty, ktorych nie udalo sie zrobic (przy FailurePolicy::PARTIAL zamowienie bez nich jest gotowe).
+    [[nodiscard]] std::vector<std::string> getFailedProducts() const;
+
+    // Termin podany przy zamowieniu (time_point::max(), jesli brak).
+    [[nodiscard]] Clock::time_point getDeadline() const;
+
+    // Do kiedy mozna odebrac gotowe zamowienie (ustawiane, gdy zamowienie jest gotowe).
+    [[nodiscard]] Clock::time_point getPickupDeadline() const;
+
+    [[nodiscard]] Clock::time_point now() const;
+
     [[nodiscard]] unsigned int getId() const;
 
     [[nodiscard]] bool isReady() const;
 
+    // Szacowana chwila gotowosci (odswiezana, gdy worker bierze zamowienie; po zakonczeniu - chwila zakonczenia).
+    [[nodiscard]] Clock::time_point estimatedReadyTime() const;
+
 
 private:
-    explicit CoasterPager(unsigned int new_id);
+    CoasterPager(unsigned int new_id, std::shared_ptr<Clock> clock_in);
 
     CoasterPager() = default;
 
@@ -210,7 +765,17 @@ private:
     bool failed;
     bool is_ready;
     mutable bool taken;
+    // worker po odbiorze nie dotyka juz pagera - dopiero wtedy wolno go zniszczyc
+    bool released;
     bool expired;
+    bool streaming;
+    // ile produktow klient juz odebral przez next()
+    std::size_t delivered;
+    Clock::time_point eta;
+    Clock::time_point deadline;
+    Clock::time_point pickup_deadline;
+
+    std::shared_ptr<Clock> clock;
 
     std::condition_variable cv_taken;
     std::mutex mutex_taken;
@@ -219,6 +784,7 @@ private:
     mutable std::mutex mutex_wait;
 
     std::vector<std::unique_ptr<Product>> products;
+    std::vector<std::string> failed_products;
 
     friend class System;
 };
@@ -228,12 +794,60 @@ private:
 //**                  SYSTEM                       **
 //***************************************************
 
+// Co robi order(), gdy kolejka zamowien jest pelna.
+enum class AdmissionPolicy {
+    UNBOUNDED,  // przyjmuje wszystko
+    REJECT,     // odrzuca od razu (ORDER_REJECTED)
+    BLOCK,      // czeka na miejsce w kolejce
+    TIMEOUT,    // czeka co najwyzej admissionTimeout ms, potem odrzuca
+    SHED        // odrzuca, gdy szacowany czas oczekiwania przekracza maxEstimatedWait ms
+};
+
+// Co sie dzieje z zamowieniem, gdy czesc produktow sie nie udala.
+enum class FailurePolicy {
+    WHOLE_ORDER,  // cale zamowienie jest nieudane, zrobione produkty wracaja do maszyn
+    PARTIAL       // zamowienie jest gotowe bez brakujacych produktow (nieudane, gdy nie ma zadnego)
+};
+
+struct SystemConfig
+{
+    // Co ile ms probowac przywrocic zepsute maszyny do menu (0 - nigdy).
+    unsigned int probeInterval = 0;
+
+    // Worker i jest przypinany do workerCpus[i % workerCpus.size()] (puste - bez przypinania).
+    std::vector<std::vector<int>> workerCpus;
+
+    // Wezel NUMA na stan maszyn (mutexy, zdrowie); -1 - wezel pierwszego procesora workerow.
+    int numaNode = -1;
+
+    AdmissionPolicy admission = AdmissionPolicy::UNBOUNDED;
+    // Limit kolejki dla REJECT/BLOCK/TIMEOUT (dla SHED opcjonalny, 0 - brak).
+    unsigned int maxQueuedOrders = 0;
+    unsigned int admissionTimeout = 0;
+    unsigned int maxEstimatedWait = 0;
+
+    // Ile getProduct() naraz moze obslugiwac dana maszyna (domyslnie 1).
+    std::unordered_map<std::string, unsigned int> machineCapacity;
+
+    // Zrodlo czasu (nullptr - RealClock); np. VirtualClock do symulacji.
+    std::shared_ptr<Clock> clock;
+
+    // Sprawiedliwe kolejkowanie miedzy tenantami (patrz FairQueue); waga domyslnie 1.
+    std::unordered_map<unsigned int, unsigned int> tenantWeights;
+    unsigned int tenantQuantum = 4;
+    // Limit zamowien w kolejce na tenanta (0 - brak); nadmiarowe sa odrzucane.
+    unsigned int maxQueuedPerTenant = 0;
+
+    FailurePolicy failurePolicy = FailurePolicy::WHOLE_ORDER;
+};
+
 class System
 {
 public:
     typedef std::unordered_map<std::string, std::shared_ptr<Machine>> machines_t;
 
-    System(machines_t machines_in, unsigned int numberOfWorkers_in, unsigned int clientTimeout_in);
+    System(machines_t machines_in, unsigned int numberOfWorkers_in, unsigned int clientTimeout_in,
+           SystemConfig config_in = SystemConfig());
 
     std::vector<WorkerReport> shutdown();
 
@@ -245,30 +859,127 @@ public:
 
     std::vector<std::unique_ptr<Product>> collectOrder(std::unique_ptr<CoasterPager> CoasterPager);
 
+    // Zamowienie z terminem: jesli worker nie wezmie go przed `deadline`, konczy sie porazka
+    // bez angazowania maszyn; przy pelnej kolejce (BLOCK/TIMEOUT) nie czekamy dluzej niz do `deadline`.
+    std::unique_ptr<CoasterPager> order(std::vector<std::string> products, Clock::time_point deadline);
+
+    // Zamowienie w imieniu tenanta (sklepu); zamowienia bez tenanta ida jako tenant 0.
+    std::unique_ptr<CoasterPager> order(unsigned int tenant, std::vector<std::string> products);
+
+    // Zamowienie strumieniowe: produkty mozna odbierac pojedynczo przez CoasterPager::next(),
+    // zanim zrobi sie cale zamowienie. Przy WHOLE_ORDER produkty juz odebrane zostaja u klienta.
+    std::unique_ptr<CoasterPager> orderStream(std::vector<std::string> products,
+                                              Clock::time_point deadline = Clock::time_point::max(),
+                                              unsigned int tenant = 0);
+
+    [[nodiscard]] OrderError tryOrder(std::vector<std::string> products, std::unique_ptr<CoasterPager> &result,
+                                      Clock::time_point deadline = Clock::time_point::max(), unsigned int tenant = 0,
+                                      bool streaming = false);
+
+    // Przy bledzie pager zostaje u wolajacego.
+    [[nodiscard]] OrderError tryCollectOrder(std::unique_ptr<CoasterPager> &CoasterPager,
+                                             std::vector<std::unique_ptr<Product>> &result);
+
     unsigned int getClientTimeout() const;
 
+    std::vector<MachineHealthReport> getMachinesHealth() const;
+
+    unsigned int getRejectedOrders() const;
+
+    std::shared_ptr<Clock> getClock() const;
+
+    // Szacowany czas realizacji zamowienia zlozonego teraz (bez blokowania).
+    std::chrono::milliseconds estimateOrder(const std::vector<std::string> &products) const;
+
+    std::vector<MachineLatencyReport> getMachinesLatency() const;
+
+    // Rywalizacja o maszyny (FairMutex); puste profile bez -DCYRK_PROFILE.
+    std::vector<MachineContentionReport> getMachinesContention() const;
+
+    std::vector<TenantReport> getTenantsReport();
+
+    // Zmiany zestawu maszyn w trakcie dzialania; false, gdy nazwa jest juz zajeta / nieznana
+    // albo System jest zamkniety.
+    bool addMachine(const std::string &name, std::shared_ptr<Machine> machine);
+
+    // Nowe zamowienia ida do nowej maszyny, przyjete wczesniej dokancza stara.
+    bool replaceMachine(const std::string &name, std::shared_ptr<Machine> machine);
+
+    // Usuwa maszyne z menu; przyjete juz zamowienia z jej produktem sa dokanczane.
+    bool retireMachine(const std::string &name);
+
 private:
-    typedef std::unordered_map<std::string, std::unique_ptr<FairMutex>> mutex_t;
-    typedef std::queue<std::pair<std::vector<std::string>, pagers_data>> queue_t;
+    friend class ShardedSystem;
+
+    OrderError validateOrder(const std::vector<std::string> &products);
+
+    std::unique_lock<std::mutex> lockOrders();
+
+    // Wymaga trzymania blokady z lockOrders(); bez may_block nigdy nie czeka.
+    OrderError admitOrder(const std::vector<std::string> &products, std::unique_lock<std::mutex> &lock,
+                          bool may_block, Clock::time_point deadline, unsigned int tenant);
+
+    double estimateWait(const std::vector<std::string> &products) const;
+
+    double estimateService(const std::vector<std::string> &products) const;
+
+    OrderError enqueueOrder(std::vector<std::string> products, std::unique_ptr<CoasterPager> &result,
+                            Clock::time_point deadline, unsigned int tenant, bool streaming);
+
+    void notifyWorkers();
+
+    std::shared_ptr<MachineSlot> makeSlot(const std::string &name, std::shared_ptr<Machine> machine) const;
+
+    std::shared_ptr<MachineSlot> findSlot(const std::string &name) const;
+
+    // Odbior czesci jednego zamowienia z kilku Systemow (ShardedSystem): albo wszystkie, albo
+    // zadna - przy bledzie pagery zostaja u wolajacego.
+    [[nodiscard]] static OrderError tryCollectOrders(const std::vector<std::unique_ptr<CoasterPager>*> &pagers,
+                                                     std::vector<std::unique_ptr<Product>> &result);
+
+    // Przejmuje pager nieodebranej czesci zamowienia: jej worker moze jeszcze produkowac albo czekac
+    // na odbior (po czasie na odbior oddaje produkty maszynom), wiec pager musi zyc, dopoki worker nie skonczy.
+    void abandonOrder(std::unique_ptr<CoasterPager> pager);
+
+    typedef FairQueue queue_t;
+
+    // przed workers - niszczone dopiero po ich zakonczeniu
+    std::vector<std::unique_ptr<CoasterPager>> abandoned;
+    std::mutex abandoned_mutex;
 
     std::vector<std::jthread> workers;
+    std::jthread prober;
 
-    std::shared_ptr<machines_t> machines;
+    // aktualna tablica maszyn; zmieniana tylko pod machines_mutex
+    std::atomic<std::shared_ptr<const machine_table_t>> machines;
+    std::mutex machines_mutex;
 
-    pojemnik dane;
+    SystemConfig config;
+
+    // wezel NUMA na stan maszyn
+    int node;
 
-    mutex_t machines_mutexes;
+    std::shared_ptr<Clock> clock;
 
-    bool closed;
     unsigned int clientTimeout;
-    unsigned int id = 0;
+
+    unsigned int numberOfWorkers;
 
     std::vector<WorkerReport> workers_reports;
-    PendingOrders pending_orders;
+    // raporty juz oddane przez shutdown(); chronione przez dane.order_mutex
+    bool reported;
 
-    Menu menu;
+    // goraco zapisywane grupy - kazda na osobnej linii cache
+    alignas(cache_line) std::atomic<unsigned int> id;
+    alignas(cache_line) std::atomic<bool> closed;
+    alignas(cache_line) std::atomic<unsigned int> rejected_orders;
 
+    pojemnik dane;
     queue_t queue_orders;
+
+    PendingOrders pending_orders;
+
+    Menu menu;
 };
 
 #endif // SYSTEM_HPP
\ No newline at end of file
@@ -1,18 +1,21 @@
 #ifndef MIM_ERR_H
 #define MIM_ERR_H
 
+#include <errno.h>
 #include <stdnoreturn.h>
 
 
 /* Assert that expression evaluates to zero (otherwise use result as error number, as in pthreads). */
 #define ASSERT_ZERO(expr)                                                                  \
     do {                                                                                   \
-        int errno = (expr);                                                                \
-        if (errno != 0)                                                                    \
+        int errno_ = (expr);                                                               \
+        if (errno_ != 0) {                                                                 \
+            errno = errno_;                                                                \
             syserr(                                                                        \
                 "Failed: %s\n\tIn function %s() in %s line %d.\n\tErrno: ",      \
                 #expr, __func__, __FILE__, __LINE__                                        \
             );                                                                             \
+        }                                                                                  \
     } while(0)
 
 
@@ -1,59 +1,295 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "err.h"
 #include "utils.h"
 
-#define MAX_TASKS 4096
 #define BUFFER_SIZE 1024
 #define BUFFER_INPUT 512
+#define CHUNK_SIZE 4096
+#define MAX_EVENTS 64
+#define ZYGOTE_MESSAGE 4096
+
+// sposoby uruchamiania zadan (EXECUTOR_SPAWN=zygote/spawn/fork)
+#define SPAWN_ZYGOTE 0
+#define SPAWN_POSIX 1
+#define SPAWN_FORK 2
+
+// na co czeka polecenie wait
+#define WAITING_TASK 0
+#define WAITING_ANY 1
+#define WAITING_ALL 2
+#define WAITING_TIME 3
+
+// zdarzenia petli watku glownego
+#define MAIN_ENDS 0
+#define MAIN_TIMER 1
+
+// Tablica zadan to kawalki o rosnacych rozmiarach: kawalek k ma TASKS_BASE * 2^k miejsc.
+// Numer zadania wyznacza miejsce bez szukania, a raz przydzielone miejsce nigdy sie
+// nie przesuwa, wiec watek I/O czyta je bez blokady.
+#define TASKS_BASE 64
+#define MAX_CHUNKS 32
+
+// co zglasza zdarzenie epolla (dolne bity data.u64, reszta to numer zadania)
+#define EV_OUT 0
+#define EV_ERR 1
+#define EV_PID 2
+#define EV_CHILD 3
+#define EV_WAKE 4
+#define EV_ZYGOTE 5
+#define EV_BITS 3
 
 typedef struct {
-    pthread_t thread_out;
-    pthread_t thread_err;
-    pthread_t thread_wait;
-    pthread_mutex_t mutex_out;
-    pthread_mutex_t mutex_err;
-    char last_out[BUFFER_SIZE];
-    char last_err[BUFFER_SIZE];
-    int pipe_out[2];
-    int pipe_err[2];
+    int pipe[2];
+    // Ostatnia linia chroniona licznikiem sekwencji: pisze tylko watek I/O, a out/err
+    // kopiuja ja bez blokady i powtarzaja odczyt, jesli w trakcie zmienila sie (nieparzysty
+    // licznik = zapis w toku).
+    atomic_uint seq;
+    size_t last_len;
+    char last[BUFFER_SIZE];
+    // zaczeta, jeszcze niezakonczona linia - zna ja tylko watek I/O
+    char line[BUFFER_SIZE];
+    size_t line_len;
+    // ostatnie capture_size bajtow strumienia (pierscien, pod capture_mutex)
+    pthread_mutex_t capture_mutex;
+    char *ring;
+    size_t captured;
+    // zrzut calego strumienia do pliku przez tee + splice (-1, gdy wylaczony)
+    int spill;
+    int spill_pipe[2];
+} stream;
+
+typedef struct task {
+    int id;
+    stream out;
+    stream err;
     pid_t childs_pid;
     pid_t pid;
     int status;
+    // pidfd procesu (-1 w trybie signalfd)
+    int pidfd;
+    atomic_bool reaped;
+    // ile zdarzen (EOF na out, EOF na err, zakonczenie procesu) brakuje do konca zadania
+    atomic_int pending;
+    // komunikat o koncu jest juz wypisany albo w kolejce (pod live_mutex)
+    bool ended;
+    // lista zywych zadan (pod live_mutex)
+    struct task *prev;
+    struct task *next;
 } task;
 
+// Polecenie dla zygoty: naglowek, potem program i argumenty jako napisy zakonczone zerem.
+// Konce potokow na stdout i stderr ida obok przez SCM_RIGHTS.
+typedef struct {
+    int id;
+    int argc;
+    size_t length;
+} spawn_request;
+
+// Odpowiedz zygoty: pid uruchomionego zadania albo status zebranego.
 typedef struct {
-    int queue[MAX_TASKS];
+    int id;
+    pid_t pid;
+    int status;
+} spawn_report;
+
+typedef struct {
+    int *queue;
     int head;
     int tail;
+    int capacity;
     pthread_mutex_t mutex;
 } queue_t;
 
 queue_t thread_queue;
 
-task tasks[MAX_TASKS];
+task *chunks[MAX_CHUNKS];
 
 pthread_mutex_t mutex;
 
 int num_tasks = 0;
 bool if_task_runs = false;
 
-void write_end(int id){
-    if(tasks[id].thread_out != 0){
-        pthread_join(tasks[id].thread_out, NULL);
-        tasks[id].thread_out = 0;
+int spawn_mode = SPAWN_ZYGOTE;
+
+// Zygota to maly jednowatkowy proces tworzony w init(), zanim powstanie jakikolwiek watek.
+// Sama robi fork i exec, wiec koszt uruchomienia nie zalezy od rozmiaru executora. Zadania sa
+// jej dziecmi, nie naszymi - to ona je zbiera i odsyla statusy osobnym gniazdem.
+pid_t zygote_pid;
+int zygote_fd = -1;
+int zygote_events = -1;
+
+// jeden watek obsluguje potoki i konce wszystkich zadan
+int epoll_fd;
+int wake_fd;
+pthread_t io_thread;
+
+// bez pidfd_open (jadro < 5.3) konce procesow przychodza jako SIGCHLD przez signalfd
+bool use_pidfd;
+int signal_fd = -1;
+sigset_t child_mask;
+sigset_t old_mask;
+
+// Watek glowny czeka w sleep i wait na wlasnym epollu: ends_fd budzi go po koncu kazdego
+// zadania, a timer_fd odmierza czas. Komunikaty o koncach wypisuje wiec od razu, a nie
+// dopiero po poleceniu - i zawsze sam, wiec nie przeplataja sie z wyjsciem polecen.
+int main_epoll;
+int ends_fd;
+int timer_fd;
+
+// Zapis wyjscia zadan: EXECUTOR_CAPTURE=<KiB> trzyma ogon kazdego strumienia w pamieci,
+// EXECUTOR_SPILL=<katalog> zapisuje calosc do <katalog>/task-<numer>.out / .err.
+size_t capture_size = 0;
+const char *spill_dir = NULL;
+
+// Pierscienie trzymamy tylko dla ostatnich keep_captures zakonczonych zadan
+// (EXECUTOR_CAPTURE_KEEP), wiec pamiec rosnie z liczba zywych zadan, a nie wszystkich.
+// kept_captures to kolejka cykliczna ich numerow (pod live_mutex, -1 = wolne miejsce).
+int keep_captures = 256;
+int *kept_captures = NULL;
+int kept_next = 0;
+
+// zadania, ktore jeszcze sie nie skonczyly, i licznik zakonczonych (pod live_mutex);
+// live_cond budzi sie przy kazdym koncu zadania
+int live_tasks = 0;
+int ended_tasks = 0;
+task *active = NULL;
+pthread_mutex_t live_mutex;
+pthread_cond_t live_cond;
+
+int chunk_of(int id, int *offset){
+    unsigned long long slot = (unsigned long long) id / TASKS_BASE + 1;
+    int k = 63 - __builtin_clzll(slot);
+    *offset = id - TASKS_BASE * (int) ((1ULL << k) - 1);
+    return k;
+}
+
+// Zadanie o danym numerze albo NULL, jesli takiego jeszcze nie bylo.
+task *get_task(int id){
+    if(id < 0 || id >= num_tasks){
+        return NULL;
+    }
+    int offset;
+    int k = chunk_of(id, &offset);
+    return &chunks[k][offset];
+}
+
+void capture_init(stream *s){
+    s->spill = -1;
+    if(capture_size > 0){
+        pthread_mutex_init(&s->capture_mutex, NULL);
+        s->ring = malloc(capture_size);
+        if(s->ring == NULL){
+            fatal("Out of memory.");
+        }
+    }
+}
+
+// Zwalnia pierscien i muteks zakonczonego zadania; dump pokaze potem pusty ogon.
+// Wolane pod live_mutex: watek I/O skonczyl juz z tym strumieniem, a dump_stream
+// bierze capture_mutex tylko pod live_mutex i tylko, gdy pierscien jeszcze jest.
+void capture_release(stream *s){
+    pthread_mutex_destroy(&s->capture_mutex);
+    free(s->ring);
+    s->ring = NULL;
+    s->captured = 0;
+}
+
+// Wolane pod live_mutex, gdy zadanie sie konczy.
+void capture_keep(task *t){
+    if(capture_size == 0){
+        return;
     }
-    if(tasks[id].thread_err != 0){
-        pthread_join(tasks[id].thread_err, NULL);
-        tasks[id].thread_err = 0;
+    if(keep_captures == 0){
+        capture_release(&t->out);
+        capture_release(&t->err);
+        return;
     }
-    if(WIFEXITED(tasks[id].status)){
-        printf("Task %d ended: status %d.\n", id, WEXITSTATUS(tasks[id].status));
+    int oldest = kept_captures[kept_next];
+    if(oldest != -1){
+        int offset;
+        int k = chunk_of(oldest, &offset);
+        capture_release(&chunks[k][offset].out);
+        capture_release(&chunks[k][offset].err);
+    }
+    kept_captures[kept_next] = t->id;
+    kept_next = (kept_next + 1) % keep_captures;
+}
+
+void spill_open(stream *s, int id, const char *suffix){
+    if(spill_dir == NULL){
+        return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/task-%d.%s", spill_dir, id, suffix);
+    s->spill = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(s->spill == -1){
+        syserr("Cannot open %s.", path);
+    }
+    ASSERT_SYS_OK(pipe2(s->spill_pipe, O_CLOEXEC));
+}
+
+void spill_close(stream *s){
+    if(s->spill == -1){
+        return;
+    }
+    ASSERT_SYS_OK(close(s->spill));
+    ASSERT_SYS_OK(close(s->spill_pipe[0]));
+    ASSERT_SYS_OK(close(s->spill_pipe[1]));
+    s->spill = -1;
+}
+
+task *new_task(){
+    int id = num_tasks;
+    int offset;
+    int k = chunk_of(id, &offset);
+    if(k >= MAX_CHUNKS){
+        fatal("Too many tasks.");
+    }
+    if(chunks[k] == NULL){
+        // miejsca przydzielamy dopiero, gdy sa potrzebne
+        chunks[k] = calloc((size_t) TASKS_BASE << k, sizeof(task));
+        if(chunks[k] == NULL){
+            fatal("Out of memory.");
+        }
+    }
+
+    task *t = &chunks[k][offset];
+    t->id = id;
+    t->pidfd = -1;
+    atomic_init(&t->reaped, false);
+    t->ended = false;
+    atomic_init(&t->out.seq, 0);
+    atomic_init(&t->err.seq, 0);
+    capture_init(&t->out);
+    capture_init(&t->err);
+    num_tasks++;
+    return t;
+}
+
+void write_end(int id){
+    task *t = get_task(id);
+    if(WIFEXITED(t->status)){
+        printf("Task %d ended: status %d.\n", id, WEXITSTATUS(t->status));
     } else {
         printf("Task %d ended: signalled.\n", id);
     }
@@ -61,17 +297,27 @@ void write_end(int id){
 
 
 void queue_init() {
+    thread_queue.queue = NULL;
     thread_queue.head = 0;
     thread_queue.tail = 0;
+    thread_queue.capacity = 0;
     pthread_mutex_init(&thread_queue.mutex, NULL);
 }
 
 void queue_destroy() {
+    free(thread_queue.queue);
     pthread_mutex_destroy(&thread_queue.mutex);
 }
 
 void queue_put(int id) {
     pthread_mutex_lock(&thread_queue.mutex);
+    if(thread_queue.tail == thread_queue.capacity){
+        thread_queue.capacity = thread_queue.capacity ? 2 * thread_queue.capacity : TASKS_BASE;
+        thread_queue.queue = realloc(thread_queue.queue, thread_queue.capacity * sizeof(int));
+        if(thread_queue.queue == NULL){
+            fatal("Out of memory.");
+        }
+    }
     thread_queue.queue[thread_queue.tail] = id;
     thread_queue.tail++;
     pthread_mutex_unlock(&thread_queue.mutex);
@@ -85,6 +331,8 @@ void queue_clear() {
         thread_queue.head++;
         write_end(id);
     }
+    thread_queue.head = 0;
+    thread_queue.tail = 0;
     pthread_mutex_unlock(&thread_queue.mutex);
 }
 
@@ -94,164 +342,900 @@ void add_or_write(int id){
         queue_put(id);
     } else {
         write_end(id);
+        fflush(stdout);
     }
     pthread_mutex_unlock(&mutex);
 }
 
-void *waiting(void *arg){
-    int id = *((int *) arg);
+// Zadanie konczy sie dopiero, gdy proces nie zyje i oba potoki sa przeczytane do konca,
+// wiec po komunikacie o koncu out/err pokazuja juz ostatnie linie.
+void finish_event(task *t){
+    if(atomic_fetch_sub(&t->pending, 1) != 1){
+        return;
+    }
+    add_or_write(t->id);
 
-    waitpid(tasks[id].childs_pid, &tasks[id].status, 0);
-    add_or_write(id);
+    pthread_mutex_lock(&live_mutex);
+    if(t->prev != NULL){
+        t->prev->next = t->next;
+    } else {
+        active = t->next;
+    }
+    if(t->next != NULL){
+        t->next->prev = t->prev;
+    }
+    live_tasks--;
+    ended_tasks++;
+    t->ended = true;
+    capture_keep(t);
+    pthread_cond_broadcast(&live_cond);
+    pthread_mutex_unlock(&live_mutex);
+
+    uint64_t one = 1;
+    ASSERT_SYS_OK(write(ends_fd, &one, sizeof(one)));
+}
 
-    free(arg);
-    return 0;
+int pidfd_open(pid_t pid){
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
 }
 
-void *reading_out(void *arg){
-    int id = *((int *) arg);
-    FILE* file = fdopen(tasks[id].pipe_out[0], "r");
-    char buffer[BUFFER_SIZE];
+// Zbiera proces zadania, jesli juz sie skonczyl; waitpid odda status tylko jednemu wolajacemu.
+void reap(task *t){
+    int status;
+    if(waitpid(t->childs_pid, &status, WNOHANG) != t->childs_pid){
+        return;
+    }
+    t->status = status;
+    atomic_store(&t->reaped, true);
+    if(t->pidfd != -1){
+        ASSERT_SYS_OK(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->pidfd, NULL));
+        ASSERT_SYS_OK(close(t->pidfd));
+        t->pidfd = -1;
+    }
+    finish_event(t);
+}
 
+void reap_children(){
+    struct signalfd_siginfo info;
+    while(read(signal_fd, &info, sizeof(info)) == sizeof(info)){
+    }
+
+    // kilka SIGCHLD moze sklejac sie w jeden - sprawdzamy wszystkie zywe zadania;
+    // reap() zdejmuje zadanie z listy, wiec najpierw ja kopiujemy
+    pthread_mutex_lock(&live_mutex);
+    task **alive = malloc((live_tasks + 1) * sizeof(task *));
+    if(alive == NULL){
+        fatal("Out of memory.");
+    }
+    int n = 0;
+    for(task *t = active;t != NULL;t = t->next){
+        alive[n++] = t;
+    }
+    pthread_mutex_unlock(&live_mutex);
+
+    for(int i = 0;i < n;i++){
+        if(!atomic_load(&alive[i]->reaped)){
+            reap(alive[i]);
+        }
+    }
+    free(alive);
+}
+
+// Statusy zadan zebranych przez zygote.
+void zygote_reap(){
+    spawn_report report;
+    while(recv(zygote_events, &report, sizeof(report), 0) == sizeof(report)){
+        int offset;
+        int k = chunk_of(report.id, &offset);
+        task *t = &chunks[k][offset];
+        t->status = report.status;
+        atomic_store(&t->reaped, true);
+        finish_event(t);
+    }
+}
+
+void publish_line(stream *s, const char *line, size_t len){
+    unsigned seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(s->last, line, len);
+    s->last_len = len;
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+// Spojna kopia ostatniej linii; watek I/O nigdy na nas nie czeka.
+void read_last(stream *s, char *line){
     while(true){
-        bool check = read_line(buffer, BUFFER_SIZE, file);
-        if(!check){
-            free(arg);
-            fclose(file);
-            return 0;
+        unsigned before = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if(before & 1){
+            continue;
+        }
+        size_t len = s->last_len;
+        if(len > BUFFER_SIZE - 1){
+            len = BUFFER_SIZE - 1;
+        }
+        memcpy(line, s->last, len);
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&s->seq, memory_order_relaxed) == before){
+            line[len] = '\0';
+            return;
+        }
+    }
+}
+
+// Dokleja do zaczetej linii, za dluga linie przycinamy do rozmiaru bufora.
+void append_line(stream *s, const char *data, size_t len){
+    if(len > BUFFER_SIZE - 1 - s->line_len){
+        len = BUFFER_SIZE - 1 - s->line_len;
+    }
+    memcpy(s->line + s->line_len, data, len);
+    s->line_len += len;
+}
+
+// Czyta z potoku to, co jest (potok jest nieblokujacy). Pamietamy tylko ostatnia linie,
+// wiec z kazdego kawalka publikujemy jedynie ostatnia pelna linie, a srodkowe pomijamy.
+void capture(stream *s, const char *data, size_t len){
+    pthread_mutex_lock(&s->capture_mutex);
+    if(len > capture_size){
+        s->captured += len - capture_size;
+        data += len - capture_size;
+        len = capture_size;
+    }
+    size_t at = s->captured % capture_size;
+    size_t first = capture_size - at < len ? capture_size - at : len;
+    memcpy(s->ring + at, data, first);
+    memcpy(s->ring, data + first, len - first);
+    s->captured += len;
+    pthread_mutex_unlock(&s->capture_mutex);
+}
+
+// Kopiuje zawartosc potoku zadania do pliku bez przechodzenia przez nasza pamiec: tee powiela
+// dane do pomocniczego potoku (nie zdejmujac ich), a splice przenosi je stamtad do pliku.
+// Zwraca, ile bajtow skopiowal - tyle potem czytamy, zeby plik i read() szly rowno; 0 na
+// koncu strumienia, -1, gdy potok jest pusty.
+ssize_t spill(task *t, stream *s){
+    ssize_t copied = tee(s->pipe[0], s->spill_pipe[1], CHUNK_SIZE, SPLICE_F_NONBLOCK);
+    if(copied == -1){
+        if(errno == EAGAIN || errno == EINTR){
+            return -1;
+        }
+        syserr("Tee from task %d failed.", t->id);
+    }
+    for(ssize_t left = copied;left > 0;){
+        ssize_t moved = splice(s->spill_pipe[0], NULL, s->spill, NULL, left, SPLICE_F_MOVE);
+        if(moved == -1 && errno == EINTR){
+            continue;
+        }
+        if(moved == -1){
+            syserr("Spill of task %d failed.", t->id);
+        }
+        left -= moved;
+    }
+    return copied;
+}
+
+void read_stream(task *t, stream *s){
+    char chunk[CHUNK_SIZE];
+    ssize_t limit = CHUNK_SIZE;
+    if(s->spill != -1){
+        // nie czytamy niczego, czego tee nie skopiowal do pliku
+        limit = spill(t, s);
+        if(limit == -1){
+            return;
+        }
+        if(limit == 0){
+            limit = CHUNK_SIZE;
+        }
+    }
+    ssize_t n = read(s->pipe[0], chunk, limit);
+    if(n == -1){
+        if(errno == EAGAIN || errno == EINTR){
+            return;
+        }
+        syserr("Read from task %d failed.", t->id);
+    }
+
+    if(n == 0){
+        // ostatnia linia moze nie miec znaku nowej linii
+        if(s->line_len > 0){
+            publish_line(s, s->line, s->line_len);
+            s->line_len = 0;
         }
-        pthread_mutex_lock(&tasks[id].mutex_out);
-        memcpy(tasks[id].last_out, buffer, BUFFER_SIZE);
-        pthread_mutex_unlock(&tasks[id].mutex_out);
+        ASSERT_SYS_OK(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->pipe[0], NULL));
+        ASSERT_SYS_OK(close(s->pipe[0]));
+        spill_close(s);
+        finish_event(t);
+        return;
+    }
+
+    if(capture_size > 0){
+        capture(s, chunk, n);
+    }
+
+    const char *end = chunk + n;
+    const char *last = memrchr(chunk, '\n', n);
+    if(last == NULL){
+        append_line(s, chunk, n);
+        return;
+    }
+
+    const char *before = memrchr(chunk, '\n', last - chunk);
+    if(before != NULL){
+        // ostatnia pelna linia lezy cala w kawalku - zaczeta wczesniej linia jest juz nieaktualna
+        size_t len = last - (before + 1);
+        if(len > BUFFER_SIZE - 1){
+            len = BUFFER_SIZE - 1;
+        }
+        publish_line(s, before + 1, len);
+    } else {
+        append_line(s, chunk, last - chunk);
+        publish_line(s, s->line, s->line_len);
     }
+
+    s->line_len = 0;
+    append_line(s, last + 1, end - (last + 1));
 }
 
-void *reading_err(void *arg){
-    int id = *((int *) arg);
-    FILE* file = fdopen(tasks[id].pipe_err[0], "r");
-    char buffer[BUFFER_SIZE];
+void *io_loop(void *arg){
+    (void) arg;
+    struct epoll_event events[MAX_EVENTS];
 
     while(true){
-        bool check = read_line(buffer, BUFFER_SIZE, file);
-        if(!check){
-            free(arg);
-            fclose(file);
-            return 0;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        ASSERT_SYS_OK(n);
+
+        for(int i = 0;i < n;i++){
+            int kind = (int) (events[i].data.u64 & ((1 << EV_BITS) - 1));
+            int offset;
+            int id = (int) (events[i].data.u64 >> EV_BITS);
+            // num_tasks zmienia watek glowny - tu wystarczy, ze miejsce zadania juz jest
+            task *t = kind < EV_CHILD ? &chunks[chunk_of(id, &offset)][offset] : NULL;
+            switch(kind) {
+                case EV_OUT:
+                    read_stream(t, &t->out);
+                    break;
+                case EV_ERR:
+                    read_stream(t, &t->err);
+                    break;
+                case EV_PID:
+                    reap(t);
+                    break;
+                case EV_CHILD:
+                    reap_children();
+                    break;
+                case EV_ZYGOTE:
+                    zygote_reap();
+                    break;
+                case EV_WAKE:
+                    return 0;
+            }
         }
-        pthread_mutex_lock(&tasks[id].mutex_err);
-        memcpy(tasks[id].last_err, buffer, BUFFER_SIZE);
-        pthread_mutex_unlock(&tasks[id].mutex_err);
     }
+}
 
+void watch(int fd, int id, int kind){
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t) id << EV_BITS) | kind;
+    ASSERT_SYS_OK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event));
 }
 
-void run(char* program, char** args) {
+void zygote_report(int fd, int id, pid_t pid, int status){
+    spawn_report report = {id, pid, status};
+    ASSERT_SYS_OK(send(fd, &report, sizeof(report), MSG_NOSIGNAL));
+}
 
-    int id = num_tasks++;
+// Dostaje jedno polecenie i uruchamia zadanie; false, gdy executor zamknal gniazdo.
+bool zygote_start(int requests, sigset_t *mask, pid_t **pids, int **ids, int *count, int *capacity){
+    spawn_request request;
+    char data[ZYGOTE_MESSAGE];
+    int fds[2];
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
 
-    ASSERT_SYS_OK(pipe(tasks[id].pipe_out));
-    ASSERT_SYS_OK(pipe(tasks[id].pipe_err));
+    struct iovec iov[2] = {{&request, sizeof(request)}, {data, ZYGOTE_MESSAGE}};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
 
-    set_close_on_exec(tasks[id].pipe_out[0], true);
-    set_close_on_exec(tasks[id].pipe_out[1], true);
-    set_close_on_exec(tasks[id].pipe_err[0], true);
-    set_close_on_exec(tasks[id].pipe_err[1], true);
+    ssize_t n = recvmsg(requests, &message, MSG_CMSG_CLOEXEC);
+    if(n == -1 && errno == EINTR){
+        return true;
+    }
+    ASSERT_SYS_OK(n);
+    if(n == 0){
+        return false;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS){
+        fatal("Zygote got no pipes.");
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    char *strings[request.argc + 2];
+    char *next = data;
+    for(int i = 0;i <= request.argc;i++){
+        strings[i] = next;
+        next += strlen(next) + 1;
+    }
+    strings[request.argc + 1] = NULL;
 
+    pid_t pid = fork();
+    ASSERT_SYS_OK(pid);
+    if(!pid){
+        ASSERT_ZERO(sigprocmask(SIG_SETMASK, mask, NULL));
+        ASSERT_SYS_OK(dup2(fds[0], STDOUT_FILENO));
+        ASSERT_SYS_OK(dup2(fds[1], STDERR_FILENO));
+        ASSERT_SYS_OK(execvp(strings[0], &strings[1]));
+        exit(1);
+    }
+    ASSERT_SYS_OK(close(fds[0]));
+    ASSERT_SYS_OK(close(fds[1]));
+
+    if(*count == *capacity){
+        *capacity = *capacity ? 2 * *capacity : TASKS_BASE;
+        *pids = realloc(*pids, *capacity * sizeof(pid_t));
+        *ids = realloc(*ids, *capacity * sizeof(int));
+        if(*pids == NULL || *ids == NULL){
+            fatal("Out of memory.");
+        }
+    }
+    (*pids)[*count] = pid;
+    (*ids)[*count] = request.id;
+    (*count)++;
+
+    zygote_report(requests, request.id, pid, 0);
+    return true;
+}
+
+void zygote_loop(int requests, int events){
+    sigset_t child, mask;
+    sigemptyset(&child);
+    sigaddset(&child, SIGCHLD);
+    ASSERT_ZERO(sigprocmask(SIG_BLOCK, &child, &mask));
+    int signals = signalfd(-1, &child, SFD_NONBLOCK | SFD_CLOEXEC);
+    ASSERT_SYS_OK(signals);
+
+    // uruchomione zadania, ktorych jeszcze nie zebralismy (pid -> numer zadania)
+    pid_t *pids = NULL;
+    int *ids = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    struct pollfd fds[2] = {{requests, POLLIN, 0}, {signals, POLLIN, 0}};
+    while(true){
+        int n = poll(fds, 2, -1);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        ASSERT_SYS_OK(n);
+
+        if(fds[1].revents & POLLIN){
+            struct signalfd_siginfo info;
+            while(read(signals, &info, sizeof(info)) == sizeof(info)){
+            }
+            int status;
+            pid_t pid;
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+                for(int i = 0;i < count;i++){
+                    if(pids[i] == pid){
+                        zygote_report(events, ids[i], pid, status);
+                        count--;
+                        pids[i] = pids[count];
+                        ids[i] = ids[count];
+                        break;
+                    }
+                }
+            }
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP)){
+            if(!zygote_start(requests, &mask, &pids, &ids, &count, &capacity)){
+                break;
+            }
+        }
+    }
+    _exit(0);
+}
+
+void zygote_init(){
+    int requests[2];
+    int events[2];
+    ASSERT_SYS_OK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, requests));
+    ASSERT_SYS_OK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, events));
+
+    fflush(stdout);
+    zygote_pid = fork();
+    ASSERT_SYS_OK(zygote_pid);
+    if(!zygote_pid){
+        ASSERT_SYS_OK(close(requests[0]));
+        ASSERT_SYS_OK(close(events[0]));
+        zygote_loop(requests[1], events[1]);
+    }
+    ASSERT_SYS_OK(close(requests[1]));
+    ASSERT_SYS_OK(close(events[1]));
+    zygote_fd = requests[0];
+    zygote_events = events[0];
+    set_nonblocking(zygote_events, true);
+}
+
+void pack_string(char *data, size_t *length, const char *string){
+    size_t len = strlen(string) + 1;
+    if(*length + len > ZYGOTE_MESSAGE){
+        fatal("Command too long.");
+    }
+    memcpy(data + *length, string, len);
+    *length += len;
+}
+
+pid_t zygote_spawn(task *t, char* program, char** args){
+    char data[ZYGOTE_MESSAGE];
+    spawn_request request = {t->id, 0, 0};
+    pack_string(data, &request.length, program);
+    for(char **arg = args;*arg != NULL;arg++){
+        pack_string(data, &request.length, *arg);
+        request.argc++;
+    }
+
+    int fds[2] = {t->out.pipe[1], t->err.pipe[1]};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov[2] = {{&request, sizeof(request)}, {data, request.length}};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ASSERT_SYS_OK(sendmsg(zygote_fd, &message, MSG_NOSIGNAL));
+
+    spawn_report report;
+    if(recv(zygote_fd, &report, sizeof(report), 0) != sizeof(report)){
+        fatal("Zygote is gone.");
+    }
+    return report.pid;
+}
+
+pid_t fork_task(task *t, char* program, char** args){
     pid_t pid = fork();
 
     ASSERT_SYS_OK(pid);
 
     if(!pid){
         // DZIECKO PIJANE
-        ASSERT_SYS_OK(close(tasks[id].pipe_out[0]));
-        ASSERT_SYS_OK(close(tasks[id].pipe_err[0]));
+        if(!use_pidfd){
+            ASSERT_ZERO(pthread_sigmask(SIG_SETMASK, &old_mask, NULL));
+        }
+        ASSERT_SYS_OK(close(t->out.pipe[0]));
+        ASSERT_SYS_OK(close(t->err.pipe[0]));
 
-        ASSERT_SYS_OK(dup2(tasks[id].pipe_out[1], STDOUT_FILENO));
-        ASSERT_SYS_OK(dup2(tasks[id].pipe_err[1], STDERR_FILENO));
+        ASSERT_SYS_OK(dup2(t->out.pipe[1], STDOUT_FILENO));
+        ASSERT_SYS_OK(dup2(t->err.pipe[1], STDERR_FILENO));
 
-        ASSERT_SYS_OK(close(tasks[id].pipe_out[1]));
-        ASSERT_SYS_OK(close(tasks[id].pipe_err[1]));
+        ASSERT_SYS_OK(close(t->out.pipe[1]));
+        ASSERT_SYS_OK(close(t->err.pipe[1]));
 
         ASSERT_SYS_OK(execvp(program, args));
         exit(1);
+    }
+    return pid;
+}
+
+// posix_spawn nie kopiuje tablic stron rodzica (glibc robi clone z CLONE_VM | CLONE_VFORK),
+// wiec koszt uruchomienia nie rosnie z rozmiarem executora. Zwraca -1, gdy sie nie uda.
+pid_t spawn_task(task *t, char* program, char** args){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    ASSERT_ZERO(posix_spawn_file_actions_init(&actions));
+    ASSERT_ZERO(posix_spawnattr_init(&attr));
+
+    // pozostale konce potokow maja FD_CLOEXEC i zamkna sie przy exec
+    ASSERT_ZERO(posix_spawn_file_actions_adddup2(&actions, t->out.pipe[1], STDOUT_FILENO));
+    ASSERT_ZERO(posix_spawn_file_actions_adddup2(&actions, t->err.pipe[1], STDERR_FILENO));
+    if(!use_pidfd){
+        ASSERT_ZERO(posix_spawnattr_setsigmask(&attr, &old_mask));
+        ASSERT_ZERO(posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK));
+    }
+
+    pid_t pid;
+    int result = posix_spawnp(&pid, program, &actions, &attr, args, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return result == 0 ? pid : -1;
+}
+
+void activate(task *t){
+    pthread_mutex_lock(&live_mutex);
+    t->prev = NULL;
+    t->next = active;
+    if(active != NULL){
+        active->prev = t;
+    }
+    active = t;
+    live_tasks++;
+    pthread_mutex_unlock(&live_mutex);
+}
+
+void run(char* program, char** args) {
+
+    task *t = new_task();
+    int id = t->id;
+
+    ASSERT_SYS_OK(pipe(t->out.pipe));
+    ASSERT_SYS_OK(pipe(t->err.pipe));
+
+    set_close_on_exec(t->out.pipe[0], true);
+    set_close_on_exec(t->out.pipe[1], true);
+    set_close_on_exec(t->err.pipe[0], true);
+    set_close_on_exec(t->err.pipe[1], true);
+
+    atomic_store(&t->pending, 3);
+    if(spawn_mode == SPAWN_ZYGOTE){
+        // zadanie musi byc zarejestrowane, zanim zygota moze odeslac jego status
+        activate(t);
+    }
+
+    spill_open(&t->out, id, "out");
+    spill_open(&t->err, id, "err");
+
+    set_nonblocking(t->out.pipe[0], true);
+    set_nonblocking(t->err.pipe[0], true);
+    watch(t->out.pipe[0], id, EV_OUT);
+    watch(t->err.pipe[0], id, EV_ERR);
+
+    pid_t pid;
+    if(spawn_mode == SPAWN_ZYGOTE){
+        pid = zygote_spawn(t, program, args);
     } else {
-        // STARY PIJANY
-        printf("Task %d started: pid %d.\n", id, pid);
-        tasks[id].childs_pid = pid;
-        tasks[id].pid = getppid();
+        pid = spawn_mode == SPAWN_POSIX ? spawn_task(t, program, args) : -1;
+        // bledu exec (np. brak programu) posix_spawnp nie zglasza w zadaniu - wtedy fork,
+        // zeby zadanie skonczylo sie tak jak dotad
+        if(pid == -1){
+            pid = fork_task(t, program, args);
+        }
+    }
 
-        ASSERT_SYS_OK(close(tasks[id].pipe_out[1]));
-        ASSERT_SYS_OK(close(tasks[id].pipe_err[1]));
+    // STARY PIJANY
+    printf("Task %d started: pid %d.\n", id, pid);
+    t->childs_pid = pid;
+    t->pid = getppid();
+    if(spawn_mode != SPAWN_ZYGOTE){
+        // reap_children() bierze zadania z listy - musza juz miec pid, inaczej waitpid(0)
+        // zebralby cudze dziecko
+        activate(t);
+    }
 
-        int *arg1 = malloc(sizeof(*arg1));
-        int *arg2 = malloc(sizeof(*arg2));
-        int *arg3 = malloc(sizeof(*arg3));
-        *arg1 = id;
-        *arg2 = id;
-        *arg3 = id;
+    ASSERT_SYS_OK(close(t->out.pipe[1]));
+    ASSERT_SYS_OK(close(t->err.pipe[1]));
 
-        ASSERT_ZERO(pthread_create(&tasks[id].thread_out, NULL, reading_out, arg2));
-        ASSERT_ZERO(pthread_create(&tasks[id].thread_err, NULL, reading_err, arg3));
-        ASSERT_ZERO(pthread_create(&tasks[id].thread_wait, NULL, waiting, arg1));
+    if(spawn_mode == SPAWN_ZYGOTE){
+        // status przysle zygota
+        return;
+    }
+    if(use_pidfd){
+        // dziala tez dla procesu, ktory juz zdazyl sie skonczyc (nikt go jeszcze nie zebral)
+        t->pidfd = pidfd_open(pid);
+        ASSERT_SYS_OK(t->pidfd);
+        watch(t->pidfd, id, EV_PID);
+    } else {
+        // SIGCHLD mogl przyjsc, zanim watek I/O widzial to zadanie
+        reap(t);
     }
 }
 
 
 void out(int id) {
-    pthread_mutex_lock(&tasks[id].mutex_out);
-    printf("Task %d stdout: '%s'.\n", id, tasks[id].last_out);
-    pthread_mutex_unlock(&tasks[id].mutex_out);
+    task *t = get_task(id);
+    if(t == NULL){
+        printf("Task %d stdout: ''.\n", id);
+        return;
+    }
+    char line[BUFFER_SIZE];
+    read_last(&t->out, line);
+    printf("Task %d stdout: '%s'.\n", id, line);
 }
 
 void err(int id){
-    pthread_mutex_lock(&tasks[id].mutex_err);
-    printf("Task %d stderr: '%s'.\n", id, tasks[id].last_err);
-    pthread_mutex_unlock(&tasks[id].mutex_err);
+    task *t = get_task(id);
+    if(t == NULL){
+        printf("Task %d stderr: ''.\n", id);
+        return;
+    }
+    char line[BUFFER_SIZE];
+    read_last(&t->err, line);
+    printf("Task %d stderr: '%s'.\n", id, line);
 }
 
-void kill_task(int id){
-    if(tasks[id].childs_pid){
-        kill(tasks[id].childs_pid, SIGINT);
+void dump_stream(int id, stream *s, const char *name){
+    size_t len = 0;
+    char *tail = NULL;
+    if(s != NULL && capture_size > 0){
+        // live_mutex trzyma pierscien (i jego muteks) przy zyciu - capture_keep go nie zwolni
+        pthread_mutex_lock(&live_mutex);
+        if(s->ring != NULL){
+            pthread_mutex_lock(&s->capture_mutex);
+            len = s->captured < capture_size ? s->captured : capture_size;
+            tail = malloc(len + 1);
+            if(tail == NULL){
+                fatal("Out of memory.");
+            }
+            size_t at = (s->captured - len) % capture_size;
+            size_t first = capture_size - at < len ? capture_size - at : len;
+            memcpy(tail, s->ring + at, first);
+            memcpy(tail + first, s->ring, len - first);
+            pthread_mutex_unlock(&s->capture_mutex);
+        }
+        pthread_mutex_unlock(&live_mutex);
+    }
+
+    printf("Task %d %s tail: %zu bytes.\n", id, name, len);
+    if(len > 0){
+        fwrite(tail, 1, len, stdout);
+        if(tail[len - 1] != '\n'){
+            putchar('\n');
+        }
     }
+    free(tail);
 }
 
-void kill_all(){
-    for(int i = 0;i < MAX_TASKS;i++){
-        if(tasks[i].childs_pid){
-            kill(tasks[i].childs_pid, SIGKILL);
+// Ogon wyjscia zadania zapamietany w pierscieniach (pusty, gdy zapis jest wylaczony).
+void dump(int id){
+    task *t = get_task(id);
+    dump_stream(id, t != NULL ? &t->out : NULL, "stdout");
+    dump_stream(id, t != NULL ? &t->err : NULL, "stderr");
+}
+
+bool wait_done(int what, task *t, int ended_before){
+    switch(what) {
+        case WAITING_TASK:
+            // nie pending == 0 - ten spada, zanim komunikat o koncu trafi do kolejki
+            return t == NULL || t->ended;
+        case WAITING_ANY:
+            return live_tasks == 0 || ended_tasks != ended_before;
+        case WAITING_ALL:
+            return live_tasks == 0;
+        default:
+            return false;
+    }
+}
+
+void arm_timer(int timeout){
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = timeout / 1000;
+    spec.it_value.tv_nsec = (long) (timeout % 1000) * 1000000;
+    ASSERT_SYS_OK(timerfd_settime(timer_fd, 0, &spec, NULL));
+}
+
+// Wypisuje konce zadan na biezaco, dopoki warunek nie zajdzie albo nie minie timeout
+// (ms, ujemny = bez limitu). false, gdy skonczyl sie czas.
+bool wait_events(int what, task *t, int ended_before, int timeout){
+    if(timeout > 0){
+        arm_timer(timeout);
+    }
+    bool expired = timeout == 0;
+    while(true){
+        queue_clear();
+        pthread_mutex_lock(&live_mutex);
+        bool done = wait_done(what, t, ended_before);
+        pthread_mutex_unlock(&live_mutex);
+        if(done || expired){
+            if(timeout > 0 && !expired){
+                arm_timer(0);
+            }
+            return done;
+        }
+
+        // czytajacy nasze wyjscie przez potok ma zobaczyc konce teraz, a nie po poleceniu
+        fflush(stdout);
+        struct epoll_event events[2];
+        int n = epoll_wait(main_epoll, events, 2, -1);
+        if(n == -1 && errno == EINTR){
+            continue;
         }
-        if(tasks[i].thread_wait != 0){
-            pthread_join(tasks[i].thread_wait, NULL);
-            tasks[i].thread_wait = 0;
+        ASSERT_SYS_OK(n);
+        for(int i = 0;i < n;i++){
+            uint64_t count;
+            if(events[i].data.u64 == MAIN_ENDS){
+                ASSERT_SYS_OK(read(ends_fd, &count, sizeof(count)));
+            } else {
+                ASSERT_SYS_OK(read(timer_fd, &count, sizeof(count)));
+                expired = true;
+            }
         }
-        if(tasks[i].thread_out != 0){
-            pthread_join(tasks[i].thread_out, NULL);
-            tasks[i].thread_out = 0;
+    }
+}
+
+void sleep_events(int timeout){
+    wait_events(WAITING_TIME, NULL, 0, timeout > 0 ? timeout : 0);
+}
+
+// Czeka na koniec zadania (albo dowolnego / wszystkich) bez odpytywania - budzi nas watek I/O,
+// gdy zadanie sie konczy. Ujemny timeout to czekanie bez limitu.
+void wait_tasks(const char *which, int timeout){
+    int what = WAITING_ALL;
+    task *t = NULL;
+    if(which != NULL && strcmp(which, "any") == 0){
+        what = WAITING_ANY;
+    } else if(which != NULL && strcmp(which, "all") != 0){
+        what = WAITING_TASK;
+        t = get_task(atoi(which));
+    }
+
+    pthread_mutex_lock(&live_mutex);
+    int ended_before = ended_tasks;
+    pthread_mutex_unlock(&live_mutex);
+
+    bool done = wait_events(what, t, ended_before, timeout);
+    if(!done){
+        printf("Wait timed out.\n");
+    }
+}
+
+void kill_task(int id){
+    task *t = get_task(id);
+    if(t != NULL && !atomic_load(&t->reaped)){
+        kill(t->childs_pid, SIGINT);
+    }
+}
+
+void kill_all(){
+    // tylko zywe zadania - koszt nie zalezy od tego, ile ich bylo od poczatku
+    pthread_mutex_lock(&live_mutex);
+    for(task *t = active;t != NULL;t = t->next){
+        if(!atomic_load(&t->reaped)){
+            kill(t->childs_pid, SIGKILL);
         }
-        if(tasks[i].thread_err != 0){
-            pthread_join(tasks[i].thread_err, NULL);
-            tasks[i].thread_err = 0;
+    }
+
+    // czekamy, az watek I/O zbierze wszystkie zadania i doczyta ich potoki
+    while(live_tasks > 0){
+        pthread_cond_wait(&live_cond, &live_mutex);
+    }
+    pthread_mutex_unlock(&live_mutex);
+
+    uint64_t one = 1;
+    ASSERT_SYS_OK(write(wake_fd, &one, sizeof(one)));
+    ASSERT_ZERO(pthread_join(io_thread, NULL));
+    ASSERT_SYS_OK(close(wake_fd));
+    if(signal_fd != -1){
+        ASSERT_SYS_OK(close(signal_fd));
+    }
+    ASSERT_SYS_OK(close(epoll_fd));
+    ASSERT_SYS_OK(close(ends_fd));
+    ASSERT_SYS_OK(close(timer_fd));
+    ASSERT_SYS_OK(close(main_epoll));
+
+    if(zygote_fd != -1){
+        // zygota konczy sie, gdy zamkniemy jej gniazdo
+        ASSERT_SYS_OK(close(zygote_fd));
+        ASSERT_SYS_OK(close(zygote_events));
+        ASSERT_SYS_OK(waitpid(zygote_pid, NULL, 0));
+    }
+
+    // wszystkie zadania sie skonczyly - pierscienie maja jeszcze tylko te zapamietane
+    if(kept_captures != NULL){
+        for(int i = 0;i < keep_captures;i++){
+            task *t = get_task(kept_captures[i]);
+            if(t != NULL){
+                capture_release(&t->out);
+                capture_release(&t->err);
+            }
         }
-        pthread_mutex_destroy(&tasks[i].mutex_out);
-        pthread_mutex_destroy(&tasks[i].mutex_err);
+    }
+    free(kept_captures);
+    for(int k = 0;k < MAX_CHUNKS;k++){
+        free(chunks[k]);
+        chunks[k] = NULL;
     }
 }
 
 void init(){
+    const char *spawn = getenv("EXECUTOR_SPAWN");
+    if(spawn != NULL && strcmp(spawn, "fork") == 0){
+        spawn_mode = SPAWN_FORK;
+    } else if(spawn != NULL && strcmp(spawn, "spawn") == 0){
+        spawn_mode = SPAWN_POSIX;
+    }
+    const char *capture = getenv("EXECUTOR_CAPTURE");
+    if(capture != NULL){
+        capture_size = (size_t) atoi(capture) * 1024;
+    }
+    const char *keep = getenv("EXECUTOR_CAPTURE_KEEP");
+    if(keep != NULL && atoi(keep) >= 0){
+        keep_captures = atoi(keep);
+    }
+    if(capture_size > 0 && keep_captures > 0){
+        kept_captures = malloc(keep_captures * sizeof(int));
+        if(kept_captures == NULL){
+            fatal("Out of memory.");
+        }
+        for(int i = 0;i < keep_captures;i++){
+            kept_captures[i] = -1;
+        }
+    }
+    spill_dir = getenv("EXECUTOR_SPILL");
+
+    if(spawn_mode == SPAWN_ZYGOTE){
+        // przed utworzeniem watkow - zygota ma byc jednowatkowa
+        zygote_init();
+    }
+
     queue_init();
     pthread_mutex_init(&mutex, NULL);
-    for(int i = 0;i < MAX_TASKS;i++){
-        tasks[i].status = 0;
-        pthread_mutex_init(&tasks[i].mutex_out, NULL);
-        pthread_mutex_init(&tasks[i].mutex_err, NULL);
-        tasks[i].thread_wait = 0;
-        tasks[i].thread_out = 0;
-        tasks[i].thread_err = 0;
+    pthread_mutex_init(&live_mutex, NULL);
+    pthread_cond_init(&live_cond, NULL);
+
+    main_epoll = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_SYS_OK(main_epoll);
+    ends_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ASSERT_SYS_OK(ends_fd);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    ASSERT_SYS_OK(timer_fd);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = MAIN_ENDS;
+    ASSERT_SYS_OK(epoll_ctl(main_epoll, EPOLL_CTL_ADD, ends_fd, &event));
+    event.data.u64 = MAIN_TIMER;
+    ASSERT_SYS_OK(epoll_ctl(main_epoll, EPOLL_CTL_ADD, timer_fd, &event));
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT_SYS_OK(epoll_fd);
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    ASSERT_SYS_OK(wake_fd);
+    watch(wake_fd, 0, EV_WAKE);
+
+    if(spawn_mode == SPAWN_ZYGOTE){
+        // zadania nie sa naszymi dziecmi - ich konce przychodza od zygoty
+        use_pidfd = false;
+        watch(zygote_events, 0, EV_ZYGOTE);
+    } else {
+        int probe = pidfd_open(getpid());
+        use_pidfd = probe != -1;
+        if(use_pidfd){
+            ASSERT_SYS_OK(close(probe));
+        } else {
+            // SIGCHLD musi byc zablokowany we wszystkich watkach, zanim jakikolwiek powstanie
+            sigemptyset(&child_mask);
+            sigaddset(&child_mask, SIGCHLD);
+            ASSERT_ZERO(pthread_sigmask(SIG_BLOCK, &child_mask, &old_mask));
+            signal_fd = signalfd(-1, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+            ASSERT_SYS_OK(signal_fd);
+            watch(signal_fd, 0, EV_CHILD);
+        }
     }
+    ASSERT_ZERO(pthread_create(&io_thread, NULL, io_loop, NULL));
 }
 
 void quit_job(){
     kill_all();
+    pthread_mutex_destroy(&live_mutex);
+    pthread_cond_destroy(&live_cond);
     pthread_mutex_destroy(&mutex);
     queue_destroy();
     exit(0);
@@ -282,7 +1266,7 @@ int main(){
                 out(atoi(partitioned[1]));
                 break;
             case 's':
-                usleep(atoi(partitioned[1]) * 1000);
+                sleep_events(atoi(partitioned[1]));
                 break;
             case 'e':
                 err(atoi(partitioned[1]));
@@ -290,6 +1274,13 @@ int main(){
             case 'k':
                 kill_task(atoi(partitioned[1]));
                 break;
+            case 'd':
+                dump(atoi(partitioned[1]));
+                break;
+            case 'w':
+                // wait <numer|any|all> [timeout w ms]
+                wait_tasks(partitioned[1], partitioned[1] != NULL && partitioned[2] != NULL ? atoi(partitioned[2]) : -1);
+                break;
             case 'q':
                 free_split_string(partitioned);
                 quit_job();
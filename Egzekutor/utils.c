@@ -27,6 +27,17 @@ void set_close_on_exec(int file_descriptor, bool value)
     ASSERT_SYS_OK(fcntl(file_descriptor, F_SETFD, flags));
 }
 
+void set_nonblocking(int file_descriptor, bool value)
+{
+    int flags = fcntl(file_descriptor, F_GETFL);
+    ASSERT_SYS_OK(flags);
+    if (value)
+        flags |= O_NONBLOCK;
+    else
+        flags &= ~O_NONBLOCK;
+    ASSERT_SYS_OK(fcntl(file_descriptor, F_SETFL, flags));
+}
+
 char** split_string(const char* s)
 {
     size_t len = strlen(s);
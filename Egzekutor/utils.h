@@ -13,6 +13,14 @@
  */
 void set_close_on_exec(int file_descriptor, bool value);
 
+/*
+ * Set or unset the 'O_NONBLOCK' flag on a given descriptor.
+ *
+ * Reads from an empty non-blocking pipe fail with EAGAIN instead of waiting,
+ * which is what an epoll-driven reader needs.
+ */
+void set_nonblocking(int file_descriptor, bool value);
+
 /*
  * Split a string into space-delimited parts.
  *